@@ -0,0 +1,71 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "stack.h"
+
+// Каждый поток выполняет ops_per_thread пар push/pop над общим стеком.
+template<typename Work>
+double run_threads(int threads, Work work) {
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(work, t);
+    }
+    for (auto& worker : workers) worker.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+double bench_mutex_stack(int threads, int ops_per_thread) {
+    FixedBufferResource resource(16 * 1024 * 1024);
+    std::pmr::polymorphic_allocator<int> alloc(&resource);
+    Stack<int> stack(alloc);
+    std::mutex mutex;
+
+    return run_threads(threads, [&](int t) {
+        for (int i = 0; i < ops_per_thread; ++i) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stack.push(t + i);
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!stack.empty()) stack.pop();
+        }
+    });
+}
+
+double bench_concurrent_stack(int threads, int ops_per_thread, std::size_t elimination_width = 0) {
+    FixedBufferResource resource(16 * 1024 * 1024);
+    ConcurrentStack<int> stack(static_cast<std::size_t>(threads) * 2, &resource, elimination_width);
+
+    return run_threads(threads, [&](int t) {
+        for (int i = 0; i < ops_per_thread; ++i) {
+            stack.push(t + i);
+            stack.try_pop();
+        }
+    });
+}
+
+int main(int argc, char** argv) {
+    int ops_per_thread = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    std::cout << std::setw(8) << "threads"
+              << std::setw(20) << "mutex Stack Mops/s"
+              << std::setw(24) << "ConcurrentStack Mops/s"
+              << std::setw(24) << "+elimination Mops/s" << "\n";
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        double total_ops = 2.0 * threads * ops_per_thread;
+        double mutex_time = bench_mutex_stack(threads, ops_per_thread);
+        double lock_free_time = bench_concurrent_stack(threads, ops_per_thread);
+        double elimination_time = bench_concurrent_stack(threads, ops_per_thread, threads / 2 + 1);
+        std::cout << std::setw(8) << threads
+                  << std::setw(20) << std::fixed << std::setprecision(2) << total_ops / mutex_time / 1e6
+                  << std::setw(24) << total_ops / lock_free_time / 1e6
+                  << std::setw(24) << total_ops / elimination_time / 1e6 << "\n";
+    }
+    return 0;
+}
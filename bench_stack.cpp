@@ -0,0 +1,436 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory_resource>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "stack.h"
+#include "fragmentation_workload.h"
+
+// Person из stack.h печатает сообщение в каждом конструкторе и деструкторе, поэтому
+// для замеров используется такая же по устройству структура без вывода.
+struct QuietPerson {
+    std::string name;
+    int age;
+
+    QuietPerson(std::string n, int a) : name(std::move(n)), age(a) {}
+};
+
+template<typename T>
+T make_value(int i);
+
+template<>
+int make_value<int>(int i) { return i; }
+
+template<>
+QuietPerson make_value<QuietPerson>(int i) {
+    return QuietPerson("person-with-a-long-name-" + std::to_string(i), i);
+}
+
+// Ресурсы памяти, на которых сравнивается Stack.
+struct FixedBuffer {
+    FixedBufferResource resource{256 * 1024 * 1024};
+    std::pmr::memory_resource* get() { return &resource; }
+};
+
+struct Monotonic {
+    std::pmr::monotonic_buffer_resource resource;
+    std::pmr::memory_resource* get() { return &resource; }
+};
+
+struct UnsynchronizedPool {
+    std::pmr::unsynchronized_pool_resource resource;
+    std::pmr::memory_resource* get() { return &resource; }
+};
+
+struct NewDelete {
+    std::pmr::memory_resource* get() { return std::pmr::new_delete_resource(); }
+};
+
+template<typename T, typename Resource>
+void BM_Push(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    for (auto _ : state) {
+        state.PauseTiming();
+        {
+            Resource resource;
+            Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+            state.ResumeTiming();
+            for (int i = 0; i < n; ++i) stack.push(make_value<T>(i));
+            benchmark::DoNotOptimize(stack.top());
+            state.PauseTiming();
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<typename T, typename Resource>
+void BM_PushPop(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    Resource resource;
+    Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+    for (int i = 0; i < n; ++i) stack.push(make_value<T>(i));
+    T value = make_value<T>(0);
+
+    for (auto _ : state) {
+        stack.push(value);
+        benchmark::DoNotOptimize(stack.top());
+        stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+template<typename T, typename Resource>
+void BM_Top(benchmark::State& state) {
+    Resource resource;
+    Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+    stack.push(make_value<T>(1));
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(stack.top());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template<typename T, typename Resource>
+void BM_Iterate(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    Resource resource;
+    Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+    for (int i = 0; i < n; ++i) stack.push(make_value<T>(i));
+
+    for (auto _ : state) {
+        std::size_t seen = 0;
+        for (T& value : stack) {
+            benchmark::DoNotOptimize(&value);
+            ++seen;
+        }
+        benchmark::DoNotOptimize(seen);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template<typename T, typename Resource>
+void BM_Clear(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    Resource resource;
+    Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int i = 0; i < n; ++i) stack.push(make_value<T>(i));
+        state.ResumeTiming();
+        stack.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Задержка отдельных push/pop с процентилями. Каждая операция замеряется
+// steady_clock, так что абсолютные значения включают цену самого замера.
+template<typename T, typename Resource>
+void BM_PushPopLatency(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    Resource resource;
+    Stack<T> stack{std::pmr::polymorphic_allocator<T>(resource.get())};
+    std::vector<double> push_ns;
+    std::vector<double> pop_ns;
+    push_ns.reserve(n);
+    pop_ns.reserve(n);
+
+    for (auto _ : state) {
+        push_ns.clear();
+        pop_ns.clear();
+        for (int i = 0; i < n; ++i) {
+            T value = make_value<T>(i);
+            auto start = std::chrono::steady_clock::now();
+            stack.push(std::move(value));
+            auto stop = std::chrono::steady_clock::now();
+            push_ns.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+        }
+        for (int i = 0; i < n; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            stack.pop();
+            auto stop = std::chrono::steady_clock::now();
+            pop_ns.push_back(std::chrono::duration<double, std::nano>(stop - start).count());
+        }
+    }
+
+    auto percentile = [](std::vector<double>& samples, double p) {
+        std::size_t k = static_cast<std::size_t>(p * (samples.size() - 1));
+        std::nth_element(samples.begin(), samples.begin() + k, samples.end());
+        return samples[k];
+    };
+    state.counters["push_p50_ns"] = percentile(push_ns, 0.50);
+    state.counters["push_p99_ns"] = percentile(push_ns, 0.99);
+    state.counters["push_p999_ns"] = percentile(push_ns, 0.999);
+    state.counters["pop_p50_ns"] = percentile(pop_ns, 0.50);
+    state.counters["pop_p99_ns"] = percentile(pop_ns, 0.99);
+    state.counters["pop_p999_ns"] = percentile(pop_ns, 0.999);
+}
+
+// push/pop над FixedBufferResource, заранее раздробленным: буфер заполняется
+// блоками разного размера, после чего освобождается range(1) процентов из них.
+void BM_PushPopFragmented(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    const int freed_percent = static_cast<int>(state.range(1));
+    FixedBufferResource resource(64 * 1024 * 1024);
+
+    struct Block {
+        void* p;
+        std::size_t bytes;
+    };
+    std::vector<Block> blocks;
+    for (int i = 0; i < 100000; ++i) {
+        std::size_t bytes = 16 + (i * 7919 % 13) * 16;
+        blocks.push_back({resource.allocate(bytes, 8), bytes});
+    }
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        if (static_cast<int>(i * 37 % 100) < freed_percent) resource.deallocate(blocks[i].p, blocks[i].bytes, 8);
+    }
+
+    Stack<int> stack{std::pmr::polymorphic_allocator<int>(&resource)};
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) stack.push(i);
+        for (int i = 0; i < n; ++i) stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+// push/pop над одним и тем же FixedBufferResource: через polymorphic_allocator
+// (виртуальные do_allocate/do_deallocate) и через FixedBufferAllocator (встраивается).
+// Release-сборка GCC 12 (-O3), одно ядро Xeon, --benchmark_min_time=0.5: около
+// 250 и 330-410 M items/s, то есть FixedBufferAllocator быстрее в 1.3-1.6 раза.
+template<typename Allocator>
+void BM_AllocatorPushPop(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    FixedBufferResource resource(16 * 1024 * 1024);
+    Stack<int, NodeStorage, Allocator> stack{Allocator(&resource)};
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) stack.push(i);
+        benchmark::DoNotOptimize(stack.top());
+        for (int i = 0; i < n; ++i) stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+// Цена трассировки: с NoTracing тот же код, что и без политики; с LatencyTracing
+// каждый push/pop и каждое выделение пишет событие в кольцевой буфер потока.
+template<typename Tracer>
+void BM_TracedPushPop(benchmark::State& state) {
+    using Resource = BasicFixedBufferResource<NoAllocationStats, NoAllocationGuard, Tracer>;
+    const int n = static_cast<int>(state.range(0));
+    Resource resource(16 * 1024 * 1024);
+    Stack<int, NodeStorage, std::pmr::polymorphic_allocator<int>, Tracer> stack(&resource);
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) stack.push(i);
+        benchmark::DoNotOptimize(stack.top());
+        for (int i = 0; i < n; ++i) stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+// Неглубокий стек (range(0) элементов) целиком: push до дна и обратно.
+// Stack над FixedBufferResource против StaticStack и SmallStack без обращений к ресурсу.
+template<typename StackType>
+void BM_ShallowPushPop(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    FixedBufferResource resource(1024 * 1024);
+    StackType stack{std::pmr::polymorphic_allocator<int>(&resource)};
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) stack.push(i);
+        benchmark::DoNotOptimize(stack.top());
+        for (int i = 0; i < n; ++i) stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+template<>
+void BM_ShallowPushPop<StaticStack<int, 64>>(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    StaticStack<int, 64> stack;
+    for (auto _ : state) {
+        for (int i = 0; i < n; ++i) stack.push(i);
+        benchmark::DoNotOptimize(stack.top());
+        for (int i = 0; i < n; ++i) stack.pop();
+    }
+    state.SetItemsProcessed(state.iterations() * n * 2);
+}
+
+struct Record {
+    long id;
+    char payload[120];
+};
+
+// Полный обход стека из range(0) крупных элементов, узлы которого разбросаны по
+// буферу в случайном порядке: заранее освобождается каждый второй блок, вперемешку,
+// и push забирает эти дыры. Сравниваются раскладка узла и дальность упреждения.
+template<typename Storage, std::size_t Distance>
+void BM_TraverseScattered(benchmark::State& state) {
+    using StackType = Stack<Record, Storage>;
+    const std::size_t n = static_cast<std::size_t>(state.range(0));
+    FixedBufferResource resource(2 * n * StackType::node_size + 64 * 1024 * 1024);
+
+    std::vector<void*> blocks(2 * n);
+    for (auto& b : blocks) b = resource.allocate(StackType::node_size, StackType::node_alignment);
+    std::vector<std::size_t> order(n);
+    for (std::size_t i = 0; i < n; ++i) order[i] = 2 * i;
+    std::uint64_t seed = 12345;
+    for (std::size_t i = n; i > 1; --i) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        std::swap(order[i - 1], order[(seed >> 33) % i]);
+    }
+    for (std::size_t i : order) resource.deallocate(blocks[i], StackType::node_size, StackType::node_alignment);
+
+    StackType stack{std::pmr::polymorphic_allocator<Record>(&resource)};
+    for (std::size_t i = 0; i < n; ++i) stack.push(Record{static_cast<long>(i), {}});
+
+    for (auto _ : state) {
+        long sum = 0;
+        for (Record& r : stack.template prefetched<Distance>()) sum += r.id + r.payload[64];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Сумма элементов стека: std::accumulate по итератору против transform_reduce
+// на range(1) потоках (0 — по числу ядер).
+template<typename Storage>
+void BM_Reduce(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    const std::size_t threads = static_cast<std::size_t>(state.range(1));
+    Stack<int, Storage> stack;
+    for (int i = 0; i < n; ++i) stack.push(i);
+    for (auto _ : state) {
+        long long sum = threads == 1
+            ? std::accumulate(stack.begin(), stack.end(), 0LL)
+            : stack.transform_reduce(0LL, std::plus<>(), [](int v) { return static_cast<long long>(v); }, threads);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Выгрузка стека в std::vector: поэлементно через итератор против copy_to.
+template<typename Storage, bool UseCopyTo>
+void BM_CopyOut(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    Stack<int, Storage> stack;
+    for (int i = 0; i < n; ++i) stack.push(i);
+    std::vector<int> out(n);
+    for (auto _ : state) {
+        if constexpr (UseCopyTo) stack.copy_to(out.data());
+        else std::copy(stack.begin(), stack.end(), out.begin());
+        benchmark::DoNotOptimize(out.data());
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// push_range в блочный стек: из указателей (memcpy) против итераторов vector (поэлементно).
+template<bool FromPointers>
+void BM_ChunkedPushRange(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    std::vector<int> values(n);
+    for (int i = 0; i < n; ++i) values[i] = i;
+    Stack<int, ChunkedStorage<>> stack;
+    for (auto _ : state) {
+        if constexpr (FromPointers) stack.push_range(values.data(), values.data() + n);
+        else stack.push_range(values.begin(), values.end());
+        benchmark::DoNotOptimize(stack.top());
+        stack.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Восстановление стека из снимка (serialize/deserialize) против поэлементного push.
+template<typename Storage>
+void BM_Deserialize(benchmark::State& state) {
+    const int n = static_cast<int>(state.range(0));
+    std::string image;
+    {
+        Stack<int, Storage> source;
+        for (int i = 0; i < n; ++i) source.push(i);
+        std::ostringstream out;
+        source.serialize(out);
+        image = out.str();
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        {
+            FixedBufferResource resource(32 * 1024 * 1024);
+            Stack<int, Storage> stack{std::pmr::polymorphic_allocator<int>(&resource)};
+            state.ResumeTiming();
+            stack.deserialize(image.data(), image.size());
+            benchmark::DoNotOptimize(stack.top());
+            state.PauseTiming();
+        }
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Случайная смешанная нагрузка (range(0) — доля выделений в процентах) на
+// InstrumentedFixedBufferResource: пропускная способность, момент первого
+// bad_alloc и фрагментация в конце прогона. seed фиксирован, прогоны сравнимы.
+void BM_FragmentationWorkload(benchmark::State& state) {
+    WorkloadConfig config;
+    config.seed = 2024;
+    config.operations = 200000;
+    config.alloc_percent = static_cast<unsigned>(state.range(0));
+    config.sample_every = 10000;
+
+    WorkloadReport report;
+    for (auto _ : state) {
+        InstrumentedFixedBufferResource resource(4 * 1024 * 1024);
+        report = run_fragmentation_workload(resource, config);
+        benchmark::DoNotOptimize(report.samples.data());
+    }
+    state.SetItemsProcessed(state.iterations() * report.operations);
+    state.counters["first_bad_alloc_op"] = static_cast<double>(report.first_bad_alloc_operation);
+    state.counters["ms_to_bad_alloc"] = report.seconds_to_bad_alloc * 1e3;
+    state.counters["fragmentation"] = report.samples.empty() ? 0.0 : report.samples.back().fragmentation;
+}
+
+#define STACK_BENCH_RESOURCES(bench, type, ...)                        \
+    BENCHMARK_TEMPLATE(bench, type, FixedBuffer) __VA_ARGS__;          \
+    BENCHMARK_TEMPLATE(bench, type, Monotonic) __VA_ARGS__;            \
+    BENCHMARK_TEMPLATE(bench, type, UnsynchronizedPool) __VA_ARGS__;   \
+    BENCHMARK_TEMPLATE(bench, type, NewDelete) __VA_ARGS__
+
+STACK_BENCH_RESOURCES(BM_Push, int, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_Push, QuietPerson, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_PushPop, int, ->Arg(1024));
+STACK_BENCH_RESOURCES(BM_PushPop, QuietPerson, ->Arg(1024));
+STACK_BENCH_RESOURCES(BM_Top, int, );
+STACK_BENCH_RESOURCES(BM_Iterate, int, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_Iterate, QuietPerson, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_Clear, int, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_Clear, QuietPerson, ->RangeMultiplier(16)->Range(256, 65536));
+STACK_BENCH_RESOURCES(BM_PushPopLatency, int, ->Arg(4096));
+STACK_BENCH_RESOURCES(BM_PushPopLatency, QuietPerson, ->Arg(4096));
+BENCHMARK(BM_PushPopFragmented)->Args({4096, 0})->Args({4096, 50})->Args({4096, 90});
+BENCHMARK_TEMPLATE(BM_Deserialize, NodeStorage)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_Deserialize, ChunkedStorage<>)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_CopyOut, NodeStorage, false)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_CopyOut, NodeStorage, true)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_CopyOut, ChunkedStorage<>, false)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_CopyOut, ChunkedStorage<>, true)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_ChunkedPushRange, false)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_ChunkedPushRange, true)->RangeMultiplier(16)->Range(256, 1 << 20);
+BENCHMARK_TEMPLATE(BM_ShallowPushPop, Stack<int>)->Arg(32);
+BENCHMARK_TEMPLATE(BM_ShallowPushPop, StaticStack<int, 64>)->Arg(32);
+BENCHMARK_TEMPLATE(BM_ShallowPushPop, SmallStack<int, 64>)->Arg(32);
+BENCHMARK_TEMPLATE(BM_AllocatorPushPop, std::pmr::polymorphic_allocator<int>)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_AllocatorPushPop, FixedBufferAllocator<int>)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_TracedPushPop, NoTracing)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_TracedPushPop, LatencyTracing)->Arg(1024);
+BENCHMARK_TEMPLATE(BM_TraverseScattered, NodeStorage, 0)->Arg(1 << 18);
+BENCHMARK_TEMPLATE(BM_TraverseScattered, LinkFirstStorage<64>, 0)->Arg(1 << 18);
+BENCHMARK_TEMPLATE(BM_TraverseScattered, LinkFirstStorage<64>, 4)->Arg(1 << 18);
+BENCHMARK_TEMPLATE(BM_TraverseScattered, LinkFirstStorage<64>, 16)->Arg(1 << 18);
+BENCHMARK_TEMPLATE(BM_Reduce, NodeStorage)->Args({1 << 20, 1})->Args({1 << 20, 0});
+BENCHMARK_TEMPLATE(BM_Reduce, ChunkedStorage<>)->Args({1 << 20, 1})->Args({1 << 20, 0});
+BENCHMARK(BM_FragmentationWorkload)->Arg(50)->Arg(55)->Arg(60);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <ostream>
+#include <vector>
+
+// Воспроизводимая случайная нагрузка на ресурс памяти: смесь выделений и освобождений
+// блоков разного размера и выравнивания. Генератор — собственный xorshift, поэтому
+// при одном и том же seed последовательность операций одинакова на любой платформе.
+struct WorkloadConfig {
+    std::uint64_t seed = 1;
+    std::size_t operations = 100000;
+    std::size_t min_size = 8;
+    std::size_t max_size = 512;
+    // Выравнивание выбирается из 1, 2, 4, ..., 2^max_alignment_log2.
+    unsigned max_alignment_log2 = 6;
+    // Доля операций-выделений (в процентах); больше 50 — куча растёт до исчерпания.
+    unsigned alloc_percent = 50;
+    // Как часто (в операциях) снимать показатель фрагментации.
+    std::size_t sample_every = 1000;
+    bool stop_on_bad_alloc = true;
+};
+
+struct WorkloadSample {
+    std::size_t operation;
+    std::size_t live_blocks;
+    std::size_t live_bytes;
+    double fragmentation;
+};
+
+struct WorkloadReport {
+    std::size_t operations = 0;
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+    std::size_t failed_allocations = 0;
+    double seconds = 0.0;
+    // Номер операции и время до первого std::bad_alloc; 0, если ресурс не исчерпан.
+    std::size_t first_bad_alloc_operation = 0;
+    double seconds_to_bad_alloc = 0.0;
+    std::vector<WorkloadSample> samples;
+
+    double operations_per_second() const { return seconds > 0 ? operations / seconds : 0.0; }
+
+    void write_csv(std::ostream& out) const {
+        out << "operation,live_blocks,live_bytes,fragmentation\n";
+        for (const WorkloadSample& s : samples) {
+            out << s.operation << ',' << s.live_blocks << ',' << s.live_bytes << ',' << s.fragmentation << '\n';
+        }
+    }
+};
+
+namespace detail {
+
+struct WorkloadRng {
+    std::uint64_t state;
+
+    explicit WorkloadRng(std::uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
+
+    std::uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+
+    std::size_t below(std::size_t bound) { return static_cast<std::size_t>(next() % bound); }
+};
+
+}
+
+// Resource — std::pmr::memory_resource с методом fragmentation(), например
+// InstrumentedFixedBufferResource. Все живые блоки освобождаются в конце.
+template<typename Resource>
+WorkloadReport run_fragmentation_workload(Resource& resource, const WorkloadConfig& config) {
+    struct Block {
+        void* p;
+        std::size_t bytes;
+        std::size_t alignment;
+    };
+
+    detail::WorkloadRng rng(config.seed);
+    std::vector<Block> live;
+    std::size_t live_bytes = 0;
+    WorkloadReport report;
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&start] {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+
+    for (std::size_t op = 1; op <= config.operations; ++op) {
+        bool allocate = live.empty() || rng.below(100) < config.alloc_percent;
+        if (allocate) {
+            std::size_t bytes = config.min_size + rng.below(config.max_size - config.min_size + 1);
+            std::size_t alignment = std::size_t(1) << rng.below(config.max_alignment_log2 + 1);
+            try {
+                live.push_back({resource.allocate(bytes, alignment), bytes, alignment});
+                live_bytes += bytes;
+                ++report.allocations;
+            } catch (const std::bad_alloc&) {
+                ++report.failed_allocations;
+                if (!report.first_bad_alloc_operation) {
+                    report.first_bad_alloc_operation = op;
+                    report.seconds_to_bad_alloc = elapsed();
+                }
+                if (config.stop_on_bad_alloc) {
+                    report.operations = op;
+                    break;
+                }
+            }
+        } else {
+            std::size_t k = rng.below(live.size());
+            resource.deallocate(live[k].p, live[k].bytes, live[k].alignment);
+            live_bytes -= live[k].bytes;
+            live[k] = live.back();
+            live.pop_back();
+            ++report.deallocations;
+        }
+
+        if (config.sample_every && op % config.sample_every == 0) {
+            report.samples.push_back({op, live.size(), live_bytes, resource.fragmentation()});
+        }
+        report.operations = op;
+    }
+    report.seconds = elapsed();
+
+    for (const Block& b : live) resource.deallocate(b.p, b.bytes, b.alignment);
+    return report;
+}
@@ -0,0 +1,3333 @@
+#pragma once
+
+#include <iostream>
+#include <memory_resource>
+#include <array>
+#include <new>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <atomic>
+#include <optional>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <chrono>
+#include <iomanip>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define FIXED_BUFFER_HAS_MMAP 1
+#else
+#define FIXED_BUFFER_HAS_MMAP 0
+#endif
+
+#if defined(__SANITIZE_ADDRESS__)
+#define FIXED_BUFFER_HAS_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FIXED_BUFFER_HAS_ASAN 1
+#endif
+#endif
+#ifndef FIXED_BUFFER_HAS_ASAN
+#define FIXED_BUFFER_HAS_ASAN 0
+#endif
+#if FIXED_BUFFER_HAS_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+// STACK_CHECKED_RESOURCE=1 подставляет AllocationGuard в FixedBufferResource, так
+// что код, называющий только FixedBufferResource, проверяется без правок исходников.
+// По умолчанию включён в отладочной сборке (без NDEBUG) и выключен в Release.
+#ifndef STACK_CHECKED_RESOURCE
+#ifdef NDEBUG
+#define STACK_CHECKED_RESOURCE 0
+#else
+#define STACK_CHECKED_RESOURCE 1
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define STACK_TRACE_HAS_TSC 1
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#else
+#define STACK_TRACE_HAS_TSC 0
+#endif
+
+// Политики статистики для BasicFixedBufferResource. NoAllocationStats пуста и все её
+// обработчики пустые, так что по умолчанию учёт не стоит ничего; AllocationStats
+// ведёт счётчики, которые можно запросить через stats() или выгрузить в JSON.
+struct NoAllocationStats {
+    static constexpr bool enabled = false;
+
+    void on_allocate(std::size_t, std::size_t) {}
+    void on_deallocate(std::size_t, std::size_t) {}
+    void on_free_block_added(std::size_t) {}
+    void on_free_block_removed(std::size_t) {}
+    void on_used(std::size_t) {}
+    void on_release() {}
+};
+
+struct AllocationStats {
+    static constexpr bool enabled = true;
+    static constexpr std::size_t histogram_size = sizeof(std::size_t) * 8;
+
+    // Число вызовов allocate и deallocate. Stack возвращает соседние узлы одним
+    // вызовом, а блок push_range — частями, так что вызовы не обязаны сходиться;
+    // сходятся allocated_bytes и deallocated_bytes, их разность равна bytes_in_use.
+    std::size_t allocations = 0;
+    std::size_t deallocations = 0;
+    std::size_t allocated_bytes = 0;
+    std::size_t deallocated_bytes = 0;
+    std::size_t bytes_in_use = 0;
+    // Округление живых блоков до целых гранул. Отступы для выравнивания больше
+    // гранулы сюда не входят: они остаются свободными блоками и видны в free_bytes.
+    std::size_t rounding_waste = 0;
+    std::size_t high_water_mark = 0;
+    std::size_t free_blocks = 0;
+    std::size_t free_bytes = 0;
+    // size_histogram[i] — число запросов размером из [2^(i-1), 2^i), для i = 0 — нулевых.
+    std::array<std::size_t, histogram_size> size_histogram{};
+
+    void on_allocate(std::size_t bytes, std::size_t granted) {
+        ++allocations;
+        allocated_bytes += granted;
+        bytes_in_use += granted;
+        rounding_waste += granted - bytes;
+        std::size_t bucket = 0;
+        for (std::size_t b = bytes; b; b >>= 1) ++bucket;
+        ++size_histogram[bucket];
+    }
+
+    void on_deallocate(std::size_t bytes, std::size_t granted) {
+        ++deallocations;
+        deallocated_bytes += granted;
+        bytes_in_use -= granted;
+        rounding_waste -= granted - bytes;
+    }
+
+    void on_free_block_added(std::size_t bytes) {
+        ++free_blocks;
+        free_bytes += bytes;
+    }
+
+    void on_free_block_removed(std::size_t bytes) {
+        --free_blocks;
+        free_bytes -= bytes;
+    }
+
+    void on_used(std::size_t used) { high_water_mark = std::max(high_water_mark, used); }
+
+    void on_release() {
+        deallocated_bytes = allocated_bytes;
+        bytes_in_use = 0;
+        rounding_waste = 0;
+        free_blocks = 0;
+        free_bytes = 0;
+    }
+};
+
+// Политики проверок для BasicFixedBufferResource. С NoAllocationGuard проверок нет
+// совсем: код защищённого режима отбрасывается при компиляции. AllocationGuard
+// окружает каждый блок красными зонами с канарейками, заполняет освобождённую
+// память ядом и держит последние освобождённые блоки в карантине. Так ловятся
+// двойное освобождение, неверный размер в deallocate, чужие указатели, выход за
+// границы блока и запись после освобождения; под AddressSanitizer красные зоны
+// и карантин ещё и помечаются недоступными.
+struct NoAllocationGuard {
+    static constexpr bool enabled = false;
+};
+
+using GuardHandler = void (*)(const char* message, const void* p);
+
+inline void abort_on_guard_error(const char* message, const void* p) {
+    std::cerr << "FixedBufferResource: " << message << " at " << p << "\n";
+    std::abort();
+}
+
+struct AllocationGuard {
+    static constexpr bool enabled = true;
+    static constexpr std::size_t quarantine_size = 64;
+
+    std::array<void*, quarantine_size> quarantine{};
+    std::size_t quarantine_head = 0;
+    std::size_t quarantined = 0;
+    // Вызывается при каждой найденной ошибке; если обработчик вернул управление,
+    // ошибочная операция пропускается.
+    GuardHandler handler = abort_on_guard_error;
+    std::size_t errors = 0;
+};
+
+namespace detail {
+
+inline void poison_memory(const void* p, std::size_t bytes) {
+#if FIXED_BUFFER_HAS_ASAN
+    ASAN_POISON_MEMORY_REGION(p, bytes);
+#else
+    (void)p;
+    (void)bytes;
+#endif
+}
+
+inline void unpoison_memory(const void* p, std::size_t bytes) {
+#if FIXED_BUFFER_HAS_ASAN
+    ASAN_UNPOISON_MEMORY_REGION(p, bytes);
+#else
+    (void)p;
+    (void)bytes;
+#endif
+}
+
+inline bool memory_is_poisoned(const void* p, std::size_t bytes) {
+#if FIXED_BUFFER_HAS_ASAN
+    return __asan_region_is_poisoned(const_cast<void*>(p), bytes) != nullptr;
+#else
+    (void)p;
+    (void)bytes;
+    return false;
+#endif
+}
+
+}
+
+// Трассировка задержек. Tracer — политика времени компиляции для Stack и
+// BasicFixedBufferResource: с NoTracing (по умолчанию) замеров нет вообще, с
+// LatencyTracing каждая операция записывается интервалом отметок TSC в кольцевой
+// буфер своего потока. Запись не берёт блокировок, буфер хранит последние
+// trace_ring_capacity событий. Вызовы вложены: push стека над трассируемым
+// ресурсом содержит allocate, так что видно, сколько ушло на выделение, а сколько
+// на конструирование. Свой Tracer — любой тип с enabled = true и статической
+// record(TraceEvent, begin, end, size), где begin и end — отметки trace_timestamp().
+enum class TraceEvent : std::uint8_t { push, pop, push_range, pop_n, allocate, deallocate };
+
+inline const char* trace_event_name(TraceEvent event) {
+    switch (event) {
+    case TraceEvent::push: return "push";
+    case TraceEvent::pop: return "pop";
+    case TraceEvent::push_range: return "push_range";
+    case TraceEvent::pop_n: return "pop_n";
+    case TraceEvent::allocate: return "allocate";
+    case TraceEvent::deallocate: return "deallocate";
+    }
+    return "unknown";
+}
+
+inline std::uint64_t trace_timestamp() noexcept {
+#if STACK_TRACE_HAS_TSC
+    return __rdtsc();
+#else
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+// Частота отметок trace_timestamp(); для TSC измеряется один раз, около 10 мс.
+inline double trace_ticks_per_microsecond() {
+#if STACK_TRACE_HAS_TSC
+    static const double ticks = [] {
+        auto start = std::chrono::steady_clock::now();
+        std::uint64_t first = trace_timestamp();
+        auto now = start;
+        while (now - start < std::chrono::milliseconds(10)) now = std::chrono::steady_clock::now();
+        std::uint64_t last = trace_timestamp();
+        return (last - first) / std::chrono::duration<double, std::micro>(now - start).count();
+    }();
+    return ticks;
+#else
+    return 1000.0;
+#endif
+}
+
+// size — запрошенные байты для allocate/deallocate и число элементов для операций стека.
+struct TraceSpan {
+    std::uint32_t thread;
+    TraceEvent event;
+    std::uint64_t begin;
+    std::uint64_t end;
+    std::size_t size;
+};
+
+namespace detail {
+
+constexpr std::size_t trace_ring_capacity = 8192;
+
+// Пишет только поток-владелец. claimed увеличивается до записи слота, published —
+// после, поэтому читатель отбрасывает слоты, которые могли быть перезаписаны, пока
+// он их копировал. Слоты пишутся с release и читаются с acquire: увидев новое
+// значение слота, читатель увидит и новый claimed (на x86 это обычные mov).
+struct TraceRing {
+    struct Slot {
+        std::atomic<std::uint64_t> begin;
+        std::atomic<std::uint64_t> end;
+        std::atomic<std::uint64_t> info;
+    };
+
+    std::array<Slot, trace_ring_capacity> slots;
+    std::atomic<std::uint64_t> claimed{0};
+    std::atomic<std::uint64_t> published{0};
+    std::atomic<std::uint64_t> start{0};
+    std::atomic<bool> owned{true};
+    std::uint32_t thread = 0;
+    TraceRing* next = nullptr;
+
+    void record(TraceEvent event, std::uint64_t begin, std::uint64_t end, std::size_t size) noexcept {
+        std::uint64_t i = published.load(std::memory_order_relaxed);
+        claimed.store(i + 1, std::memory_order_relaxed);
+        Slot& slot = slots[i % trace_ring_capacity];
+        slot.begin.store(begin, std::memory_order_release);
+        slot.end.store(end, std::memory_order_release);
+        slot.info.store(static_cast<std::uint64_t>(event) << 56 | (size & ((std::uint64_t(1) << 56) - 1)),
+                        std::memory_order_release);
+        published.store(i + 1, std::memory_order_release);
+    }
+
+    void collect(std::vector<TraceSpan>& out) const {
+        std::uint64_t last = published.load(std::memory_order_acquire);
+        std::uint64_t first = std::max(start.load(std::memory_order_relaxed),
+                                       last > trace_ring_capacity ? last - trace_ring_capacity : 0);
+        std::size_t old_size = out.size();
+        for (std::uint64_t i = first; i < last; ++i) {
+            const Slot& slot = slots[i % trace_ring_capacity];
+            std::uint64_t info = slot.info.load(std::memory_order_acquire);
+            out.push_back({thread, static_cast<TraceEvent>(info >> 56), slot.begin.load(std::memory_order_acquire),
+                           slot.end.load(std::memory_order_acquire),
+                           static_cast<std::size_t>(info & ((std::uint64_t(1) << 56) - 1))});
+        }
+        std::uint64_t written = claimed.load(std::memory_order_relaxed);
+        if (written > trace_ring_capacity && written - trace_ring_capacity > first) {
+            std::size_t stale = static_cast<std::size_t>(std::min(written - trace_ring_capacity, last) - first);
+            out.erase(out.begin() + old_size, out.begin() + old_size + stale);
+        }
+    }
+};
+
+// Буферы не освобождаются до конца программы: после выхода потока его буфер
+// достаётся следующему новому потоку вместе с ещё не выгруженными событиями.
+struct TraceRegistry {
+    std::atomic<TraceRing*> rings{nullptr};
+    std::atomic<std::uint32_t> ring_count{0};
+};
+
+inline TraceRegistry& trace_registry() {
+    static TraceRegistry registry;
+    return registry;
+}
+
+inline TraceRing* acquire_trace_ring() {
+    TraceRegistry& registry = trace_registry();
+    for (TraceRing* r = registry.rings.load(std::memory_order_acquire); r; r = r->next) {
+        bool expected = false;
+        if (r->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) return r;
+    }
+    TraceRing* ring = new TraceRing;
+    ring->thread = registry.ring_count.fetch_add(1, std::memory_order_relaxed);
+    ring->next = registry.rings.load(std::memory_order_relaxed);
+    while (!registry.rings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+    }
+    return ring;
+}
+
+struct TraceRingOwner {
+    TraceRing* ring = nullptr;
+
+    ~TraceRingOwner() {
+        if (ring) ring->owned.store(false, std::memory_order_release);
+    }
+};
+
+inline TraceRing& trace_ring() {
+    thread_local TraceRingOwner owner;
+    if (!owner.ring) owner.ring = acquire_trace_ring();
+    return *owner.ring;
+}
+
+// Замеряет время жизни объекта; без трассировки пуст и исчезает при компиляции.
+template<typename Tracer, bool = Tracer::enabled>
+class TraceScope {
+public:
+    explicit TraceScope(TraceEvent, std::size_t = 0) noexcept {}
+};
+
+template<typename Tracer>
+class TraceScope<Tracer, true> {
+public:
+    explicit TraceScope(TraceEvent event, std::size_t size = 0) noexcept
+        : event(event), size(size), begin(trace_timestamp()) {}
+
+    ~TraceScope() { Tracer::record(event, begin, trace_timestamp(), size); }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TraceEvent event;
+    std::size_t size;
+    std::uint64_t begin;
+};
+
+// Число элементов диапазона для события push_range, если его можно узнать без прохода.
+template<typename Tracer, typename InputIt>
+std::size_t traced_range_size(InputIt first, InputIt last) {
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (Tracer::enabled && std::is_base_of_v<std::forward_iterator_tag, category>) {
+        return static_cast<std::size_t>(std::distance(first, last));
+    } else {
+        return 0;
+    }
+}
+
+}
+
+struct NoTracing {
+    static constexpr bool enabled = false;
+};
+
+struct LatencyTracing {
+    static constexpr bool enabled = true;
+
+    static void record(TraceEvent event, std::uint64_t begin, std::uint64_t end, std::size_t size) noexcept {
+        detail::trace_ring().record(event, begin, end, size);
+    }
+};
+
+// События всех потоков, записанные LatencyTracing, упорядоченные по началу.
+// Можно вызывать, пока другие потоки продолжают писать.
+inline std::vector<TraceSpan> collect_trace() {
+    std::vector<TraceSpan> spans;
+    for (detail::TraceRing* r = detail::trace_registry().rings.load(std::memory_order_acquire); r; r = r->next) {
+        r->collect(spans);
+    }
+    std::sort(spans.begin(), spans.end(),
+              [](const TraceSpan& a, const TraceSpan& b) { return a.begin < b.begin; });
+    return spans;
+}
+
+// Забывает уже записанные события; следующий collect_trace вернёт только новые.
+inline void clear_trace() {
+    for (detail::TraceRing* r = detail::trace_registry().rings.load(std::memory_order_acquire); r; r = r->next) {
+        r->start.store(r->published.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+// Формат Chrome trace (chrome://tracing, Perfetto): по событию "X" на интервал,
+// время в микросекундах от первого события.
+inline void write_chrome_trace(std::ostream& out, const std::vector<TraceSpan>& spans) {
+    double ticks = trace_ticks_per_microsecond();
+    std::uint64_t origin = spans.empty() ? 0 : spans.front().begin;
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+    for (std::size_t i = 0; i < spans.size(); ++i) {
+        const TraceSpan& s = spans[i];
+        out << (i ? "," : "") << "\n{\"name\":\"" << trace_event_name(s.event) << "\",\"cat\":\"stack\",\"ph\":\"X\""
+            << ",\"ts\":" << (s.begin - origin) / ticks << ",\"dur\":" << (s.end - s.begin) / ticks
+            << ",\"pid\":0,\"tid\":" << s.thread << ",\"args\":{\"size\":" << s.size << "}}";
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    out.flags(flags);
+    out.precision(precision);
+}
+
+// Плоская таблица для скриптов и сравнения с perf: по строке на событие, время в наносекундах.
+inline void write_trace_csv(std::ostream& out, const std::vector<TraceSpan>& spans) {
+    double ticks_per_ns = trace_ticks_per_microsecond() / 1000.0;
+    out << "thread,event,begin_ns,duration_ns,size\n";
+    for (const TraceSpan& s : spans) {
+        out << s.thread << ',' << trace_event_name(s.event) << ','
+            << static_cast<std::uint64_t>(s.begin / ticks_per_ns) << ','
+            << static_cast<std::uint64_t>((s.end - s.begin) / ticks_per_ns) << ',' << s.size << '\n';
+    }
+}
+
+// Общая база всех BasicFixedBufferResource: по ней Stack одним dynamic_cast узнаёт,
+// можно ли возвращать ресурсу блоки частями, какие бы политики ни были выбраны.
+class FixedBufferResourceBase : public std::pmr::memory_resource {
+public:
+    virtual bool accepts_partial_deallocation() const noexcept = 0;
+};
+
+// Буфер делится на гранулы по alignof(std::max_align_t) байт; любой блок занимает
+// целое число гранул, поэтому минимальный размер блока равен одной грануле (16 байт
+// на x86-64). Служебные данные хранятся внутри самого буфера: в начале лежат две
+// битовые карты (начала и концы свободных блоков, 2 бита на гранулу), а каждый
+// свободный блок содержит заголовок со ссылками корзины и копию размера в конце.
+// Поэтому ни allocate, ни deallocate не обращаются к глобальной куче.
+// Поскольку учёт ведётся по гранулам, выделенный блок можно возвращать частями,
+// если каждая часть выровнена на гранулу и занимает целое число гранул.
+template<typename Stats = NoAllocationStats, typename Guard = NoAllocationGuard, typename Tracer = NoTracing>
+class BasicFixedBufferResource : public FixedBufferResourceBase, private Stats, private Guard {
+public:
+    static constexpr std::size_t granule = alignof(std::max_align_t);
+    // В защищённом режиме у каждого блока свой заголовок, и вернуть его частями нельзя.
+    static constexpr bool partial_deallocation = !Guard::enabled;
+
+private:
+    using index_type = std::uint32_t;
+    static constexpr index_type npos = std::numeric_limits<index_type>::max();
+
+    struct FreeHeader {
+        index_type size;
+        index_type prev;
+        index_type next;
+    };
+    static_assert(sizeof(FreeHeader) + sizeof(index_type) <= granule,
+                  "free block header and footer must fit into one granule");
+
+    char* buffer;
+    std::size_t buffer_size;
+    std::size_t used = 0;
+    std::uint64_t* start_bits = nullptr;
+    std::uint64_t* end_bits = nullptr;
+    std::size_t meta_size = 0;
+
+    // Свободные блоки разложены по классам размеров: в корзине i лежат блоки
+    // из [2^i, 2^(i+1)) гранул. Бит i в nonempty_bins выставлен, если корзина i не пуста.
+    static constexpr std::size_t bin_count = sizeof(index_type) * 8;
+    std::array<index_type, bin_count> free_bins;
+    std::size_t nonempty_bins = 0;
+
+    static std::size_t bin_index(std::size_t granules) {
+        std::size_t index = 0;
+        while (granules >>= 1) ++index;
+        return index;
+    }
+
+    // Запрос, который нельзя округлить до гранулы без переполнения, не выполним.
+    static std::size_t granules_for(std::size_t bytes) {
+        if (bytes > std::numeric_limits<std::size_t>::max() - granule) throw std::bad_alloc();
+        return bytes == 0 ? 1 : (bytes + granule - 1) / granule;
+    }
+
+    static bool test_bit(const std::uint64_t* bits, std::size_t i) {
+        return (bits[i / 64] >> (i % 64)) & 1;
+    }
+
+    static void set_bit(std::uint64_t* bits, std::size_t i, bool value) {
+        std::uint64_t mask = std::uint64_t(1) << (i % 64);
+        if (value) bits[i / 64] |= mask;
+        else bits[i / 64] &= ~mask;
+    }
+
+    FreeHeader* header(std::size_t i) const {
+        return std::launder(reinterpret_cast<FreeHeader*>(buffer + i * granule));
+    }
+
+    index_type footer(std::size_t end) const {
+        index_type size;
+        std::memcpy(&size, buffer + end * granule - sizeof(index_type), sizeof(index_type));
+        return size;
+    }
+
+    void push_free(std::size_t i, std::size_t n) {
+        std::size_t bin = bin_index(n);
+        index_type head = free_bins[bin];
+        ::new (buffer + i * granule) FreeHeader{static_cast<index_type>(n), npos, head};
+        if (head != npos) header(head)->prev = static_cast<index_type>(i);
+        free_bins[bin] = static_cast<index_type>(i);
+
+        index_type size = static_cast<index_type>(n);
+        std::memcpy(buffer + (i + n) * granule - sizeof(index_type), &size, sizeof(index_type));
+        set_bit(start_bits, i, true);
+        set_bit(end_bits, i + n - 1, true);
+        nonempty_bins |= std::size_t(1) << bin;
+        this->on_free_block_added(n * granule);
+    }
+
+    void erase_free(std::size_t i) {
+        FreeHeader* h = header(i);
+        std::size_t bin = bin_index(h->size);
+        if (h->prev != npos) header(h->prev)->next = h->next;
+        else free_bins[bin] = h->next;
+        if (h->next != npos) header(h->next)->prev = h->prev;
+        if (free_bins[bin] == npos) nonempty_bins &= ~(std::size_t(1) << bin);
+
+        set_bit(start_bits, i, false);
+        set_bit(end_bits, i + h->size - 1, false);
+        this->on_free_block_removed(h->size * granule);
+    }
+
+    // Индекс первой гранулы с адресом, выровненным на alignment, начиная с i.
+    std::size_t align_index(std::size_t i, std::size_t alignment) const {
+        if (alignment <= granule) return i;
+        std::uintptr_t addr = reinterpret_cast<std::uintptr_t>(buffer + i * granule);
+        std::uintptr_t aligned = (addr + alignment - 1) & ~(std::uintptr_t(alignment) - 1);
+        return i + (aligned - addr) / granule;
+    }
+
+    void* take_free(std::size_t i, std::size_t n, std::size_t alignment) {
+        std::size_t block_size = header(i)->size;
+        std::size_t start = align_index(i, alignment);
+        if (start + n > i + block_size) return nullptr;
+
+        erase_free(i);
+        if (start > i) {
+            push_free(i, start - i);
+        }
+        if (start + n < i + block_size) {
+            push_free(start + n, i + block_size - start - n);
+        }
+        return buffer + start * granule;
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        detail::TraceScope<Tracer> trace(TraceEvent::deallocate, bytes);
+        if constexpr (Guard::enabled) guarded_deallocate(p, bytes, alignment);
+        else deallocate_raw(p, bytes, alignment);
+    }
+
+    void deallocate_raw(void* p, std::size_t bytes, std::size_t alignment) {
+        if (!p) return;
+        if (overflow && !owns(p, bytes)) {
+            deallocate_overflow(p, bytes, alignment);
+            return;
+        }
+        std::size_t start = (static_cast<char*>(p) - buffer) / granule;
+        std::size_t end = start + granules_for(bytes);
+        this->on_deallocate(bytes, granules_for(bytes) * granule);
+        std::size_t used_end = used / granule;
+
+        if (end < used_end && test_bit(start_bits, end)) {
+            std::size_t next_size = header(end)->size;
+            erase_free(end);
+            end += next_size;
+        }
+        if (start > meta_size / granule && test_bit(end_bits, start - 1)) {
+            std::size_t prev_start = start - footer(start);
+            erase_free(prev_start);
+            start = prev_start;
+        }
+
+        if (end == used_end) {
+            used = start * granule;
+        } else {
+            push_free(start, end - start);
+        }
+    }
+
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        detail::TraceScope<Tracer> trace(TraceEvent::allocate, bytes);
+        if constexpr (Guard::enabled) return guarded_allocate(bytes, alignment);
+        else return allocate_raw(bytes, alignment);
+    }
+
+    void* allocate_raw(std::size_t bytes, std::size_t alignment) {
+        if (void* p = try_allocate(bytes, alignment)) return p;
+        return allocate_overflow(bytes, alignment);
+    }
+
+    void* try_allocate(std::size_t bytes, std::size_t alignment) {
+        std::size_t n = granules_for(bytes);
+        void* p = allocate_granules(n, alignment);
+        if (p) this->on_allocate(bytes, n * granule);
+        return p;
+    }
+
+    void* allocate_granules(std::size_t n, std::size_t alignment) {
+        // Быстрый путь: смотрим только первый блок в каждой непустой корзине,
+        // начиная с класса запрошенного размера. Для повторяющихся запросов
+        // одного размера (узлы Stack) подходящий блок лежит первым в своей корзине.
+        std::size_t bin = bin_index(n);
+        for (std::size_t mask = nonempty_bins >> bin; mask; mask >>= 1, ++bin) {
+            if (!(mask & 1)) continue;
+            if (void* p = take_free(free_bins[bin], n, alignment)) return p;
+        }
+
+        std::size_t used_end = used / granule;
+        std::size_t start = align_index(used_end, alignment);
+        if (start + n <= buffer_size / granule) {
+            if (start > used_end) push_free(used_end, start - used_end);
+            used = (start + n) * granule;
+            this->on_used(used);
+            return buffer + start * granule;
+        }
+
+        // Буфер исчерпан: прежде чем сдаться, просматриваем корзины целиком.
+        bin = bin_index(n);
+        for (std::size_t mask = nonempty_bins >> bin; mask; mask >>= 1, ++bin) {
+            if (!(mask & 1)) continue;
+            for (index_type i = free_bins[bin]; i != npos; i = header(i)->next) {
+                if (void* p = take_free(i, n, alignment)) return p;
+            }
+        }
+        return nullptr;
+    }
+
+    // Дополнительные буферы, которые берутся у upstream, когда основной исчерпан.
+    // Каждый следующий вдвое больше предыдущего; заголовок лежит в начале того же
+    // блока, что и сам буфер, так что цепочка тоже не трогает глобальную кучу.
+    struct Overflow {
+        BasicFixedBufferResource arena;
+        Overflow* next;
+        std::size_t block_size;
+
+        Overflow(char* storage, std::size_t size, Overflow* n, std::size_t block)
+            : arena(storage, size), next(n), block_size(block) {}
+    };
+
+    std::pmr::memory_resource* upstream = nullptr;
+    Overflow* overflow = nullptr;
+    std::size_t next_overflow_size = 0;
+    // Кто освобождает buffer: ::operator delete, никто (чужой буфер) или munmap.
+    enum class Ownership { heap, external, mapping };
+    Ownership ownership = Ownership::heap;
+    std::size_t mapping_size = 0;
+    bool huge_pages = false;
+
+    bool owns(const void* p, std::size_t bytes) const {
+        const char* c = static_cast<const char*>(p);
+        return c >= buffer && c + bytes <= buffer + buffer_size;
+    }
+
+    void* allocate_overflow(std::size_t bytes, std::size_t alignment) {
+        if (!upstream) throw std::bad_alloc();
+        for (Overflow* o = overflow; o; o = o->next) {
+            if (void* p = o->arena.try_allocate(bytes, alignment)) {
+                this->on_allocate(bytes, granules_for(bytes) * granule);
+                return p;
+            }
+        }
+
+        std::size_t header_size = (sizeof(Overflow) + granule - 1) / granule * granule;
+        std::size_t limit = (std::numeric_limits<std::size_t>::max() - header_size - 4 * granule) / 2;
+        if (alignment > limit || bytes > limit - alignment) throw std::bad_alloc();
+        std::size_t size = std::max(next_overflow_size, 2 * (bytes + alignment) + 4 * granule);
+        if (size > std::numeric_limits<std::size_t>::max() - header_size) throw std::bad_alloc();
+        char* block = static_cast<char*>(upstream->allocate(header_size + size, granule));
+        overflow = ::new (block) Overflow(block + header_size, size, overflow, header_size + size);
+        next_overflow_size = size <= std::numeric_limits<std::size_t>::max() / 2 ? size * 2 : size;
+
+        void* p = overflow->arena.try_allocate(bytes, alignment);
+        if (!p) throw std::bad_alloc();
+        this->on_allocate(bytes, granules_for(bytes) * granule);
+        return p;
+    }
+
+    void deallocate_overflow(void* p, std::size_t bytes, std::size_t alignment) {
+        for (Overflow** link = &overflow; *link; link = &(*link)->next) {
+            Overflow* o = *link;
+            if (!o->arena.owns(p, bytes)) continue;
+            o->arena.deallocate_raw(p, bytes, alignment);
+            this->on_deallocate(bytes, granules_for(bytes) * granule);
+            // Опустевший буфер возвращаем upstream, кроме самого нового.
+            if (o != overflow && o->arena.used == o->arena.meta_size) {
+                *link = o->next;
+                free_overflow_block(o);
+            }
+            return;
+        }
+        assert(false && "pointer does not belong to this FixedBufferResource");
+    }
+
+    void free_overflow_block(Overflow* o) {
+        std::size_t block_size = o->block_size;
+        if constexpr (Guard::enabled) detail::unpoison_memory(o, block_size);
+        o->~Overflow();
+        upstream->deallocate(o, block_size, granule);
+    }
+
+    void free_overflow() {
+        while (overflow) {
+            Overflow* o = overflow;
+            overflow = o->next;
+            free_overflow_block(o);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    bool accepts_partial_deallocation() const noexcept final { return partial_deallocation; }
+
+private:
+    // Защищённый блок: [канарейки | заголовок][данные][канарейки]. Передняя зона
+    // занимает max(granule, alignment) байт, чтобы данные сохранили выравнивание,
+    // задняя — остаток последней гранулы данных и ещё одну гранулу.
+    struct GuardHeader {
+        std::uint32_t magic;
+        std::uint32_t alignment;
+        std::uint64_t bytes;
+    };
+    static_assert(sizeof(GuardHeader) <= granule, "guard header must fit into one granule");
+
+    static constexpr std::uint32_t live_magic = 0x4556494C;   // "LIVE"
+    static constexpr std::uint32_t freed_magic = 0x45455246;  // "FREE"
+    static constexpr unsigned char canary_byte = 0xFD;
+    static constexpr unsigned char fresh_byte = 0xCD;
+    static constexpr unsigned char freed_byte = 0xDD;
+
+    static std::size_t front_zone(std::size_t alignment) { return std::max(granule, alignment); }
+
+    static std::size_t guarded_size(std::size_t bytes, std::size_t alignment) {
+        std::size_t front = front_zone(alignment);
+        if (bytes > std::numeric_limits<std::size_t>::max() - front - 2 * granule) throw std::bad_alloc();
+        return front + granules_for(bytes) * granule + granule;
+    }
+
+    static char* guard_header_address(char* p) { return p - sizeof(GuardHeader); }
+
+    // Читает заголовок, не меняя того, помечена ли эта память для ASan.
+    static GuardHeader read_guard_header(char* p) {
+        char* address = guard_header_address(p);
+        bool poisoned = detail::memory_is_poisoned(address, sizeof(GuardHeader));
+        detail::unpoison_memory(address, sizeof(GuardHeader));
+        GuardHeader h;
+        std::memcpy(&h, address, sizeof(h));
+        if (poisoned) detail::poison_memory(address, sizeof(GuardHeader));
+        return h;
+    }
+
+    static bool red_zones_intact(const char* p, const GuardHeader& h) {
+        const char* block = p - front_zone(h.alignment);
+        std::size_t front = front_zone(h.alignment) - sizeof(GuardHeader);
+        std::size_t rear = granules_for(h.bytes) * granule + granule - h.bytes;
+        for (std::size_t i = 0; i < front; ++i) {
+            if (static_cast<unsigned char>(block[i]) != canary_byte) return false;
+        }
+        for (std::size_t i = 0; i < rear; ++i) {
+            if (static_cast<unsigned char>(p[h.bytes + i]) != canary_byte) return false;
+        }
+        return true;
+    }
+
+    bool contains(const void* p) const {
+        if (owns(p, 1)) return true;
+        for (Overflow* o = overflow; o; o = o->next) {
+            if (o->arena.owns(p, 1)) return true;
+        }
+        return false;
+    }
+
+    void guard_error(const char* message, const void* p) {
+        ++this->errors;
+        this->handler(message, p);
+    }
+
+    void* guarded_allocate(std::size_t bytes, std::size_t alignment) {
+        std::size_t front = front_zone(alignment);
+        std::size_t total = guarded_size(bytes, alignment);
+        char* block = static_cast<char*>(allocate_raw(total, alignment));
+        char* p = block + front;
+        std::memset(block, canary_byte, front - sizeof(GuardHeader));
+        GuardHeader h{live_magic, static_cast<std::uint32_t>(alignment), bytes};
+        std::memcpy(guard_header_address(p), &h, sizeof(h));
+        std::memset(p, fresh_byte, bytes);
+        std::memset(p + bytes, canary_byte, total - front - bytes);
+        detail::poison_memory(block, front);
+        detail::poison_memory(p + bytes, total - front - bytes);
+        return p;
+    }
+
+    void guarded_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) {
+        if (!ptr) return;
+        char* p = static_cast<char*>(ptr);
+        if (!contains(p) || !contains(guard_header_address(p))) {
+            guard_error("pointer does not belong to this resource", p);
+            return;
+        }
+        GuardHeader h = read_guard_header(p);
+        if (h.magic == freed_magic) {
+            guard_error("double free", p);
+            return;
+        }
+        if (h.magic != live_magic) {
+            guard_error("pointer was not returned by allocate or its header is corrupted", p);
+            return;
+        }
+        if (h.bytes != bytes || h.alignment != alignment) {
+            guard_error("size or alignment does not match the allocation", p);
+            return;
+        }
+
+        std::size_t total = guarded_size(bytes, alignment);
+        char* block = p - front_zone(alignment);
+        detail::unpoison_memory(block, total);
+        if (!red_zones_intact(p, h)) guard_error("red zone overwritten (buffer overflow)", p);
+        h.magic = freed_magic;
+        std::memcpy(guard_header_address(p), &h, sizeof(h));
+        std::memset(p, freed_byte, bytes);
+        detail::poison_memory(block, total);
+
+        if (this->quarantined == Guard::quarantine_size) evict_quarantined();
+        this->quarantine[(this->quarantine_head + this->quarantined) % Guard::quarantine_size] = p;
+        ++this->quarantined;
+    }
+
+    // Возвращает самый старый блок карантина в буфер, проверив, что после
+    // освобождения в него никто не писал. Красные зоны проверены ещё в deallocate.
+    void evict_quarantined() {
+        char* p = static_cast<char*>(this->quarantine[this->quarantine_head]);
+        this->quarantine_head = (this->quarantine_head + 1) % Guard::quarantine_size;
+        --this->quarantined;
+
+        GuardHeader h = read_guard_header(p);
+        std::size_t total = guarded_size(h.bytes, h.alignment);
+        char* block = p - front_zone(h.alignment);
+        detail::unpoison_memory(block, total);
+        bool untouched = true;
+        for (std::size_t i = 0; untouched && i < h.bytes; ++i) {
+            untouched = static_cast<unsigned char>(p[i]) == freed_byte;
+        }
+        if (!untouched) guard_error("freed block was written to (use after free)", p);
+        deallocate_raw(block, total, h.alignment);
+    }
+
+    void init_buffer() {
+        std::size_t words = (buffer_size / granule + 63) / 64;
+        meta_size = std::min(buffer_size, (2 * words * sizeof(std::uint64_t) + granule - 1) / granule * granule);
+        start_bits = reinterpret_cast<std::uint64_t*>(buffer);
+        end_bits = start_bits + words;
+        std::memset(buffer, 0, meta_size);
+        used = meta_size;
+        free_bins.fill(npos);
+    }
+
+    void free_storage() noexcept {
+        if constexpr (Guard::enabled) detail::unpoison_memory(buffer, buffer_size);
+        if (upstream) free_overflow();
+        if (ownership == Ownership::heap) ::operator delete(buffer, std::align_val_t(granule));
+#if FIXED_BUFFER_HAS_MMAP
+        if (ownership == Ownership::mapping && buffer) ::munmap(buffer, mapping_size);
+#endif
+    }
+
+    void steal(BasicFixedBufferResource& other) noexcept {
+        static_cast<Stats&>(*this) = static_cast<const Stats&>(other);
+        static_cast<Guard&>(*this) = static_cast<const Guard&>(other);
+        static_cast<Guard&>(other) = Guard();
+        buffer = other.buffer;
+        buffer_size = other.buffer_size;
+        used = other.used;
+        start_bits = other.start_bits;
+        end_bits = other.end_bits;
+        meta_size = other.meta_size;
+        free_bins = other.free_bins;
+        nonempty_bins = other.nonempty_bins;
+        upstream = other.upstream;
+        overflow = other.overflow;
+        next_overflow_size = other.next_overflow_size;
+        ownership = other.ownership;
+        mapping_size = other.mapping_size;
+        huge_pages = other.huge_pages;
+
+        other.buffer = nullptr;
+        other.buffer_size = 0;
+        other.used = 0;
+        other.start_bits = other.end_bits = nullptr;
+        other.meta_size = 0;
+        other.free_bins.fill(npos);
+        other.nonempty_bins = 0;
+        other.upstream = nullptr;
+        other.overflow = nullptr;
+        other.ownership = Ownership::external;
+        other.mapping_size = 0;
+        other.huge_pages = false;
+    }
+
+public:
+    explicit BasicFixedBufferResource(std::size_t size = 1024 * 1024)
+        : buffer_size(size / granule * granule) {
+        if (buffer_size / granule >= npos) throw std::length_error("FixedBufferResource: buffer is too large");
+        buffer = static_cast<char*>(::operator new(buffer_size, std::align_val_t(granule)));
+        init_buffer();
+    }
+
+    // Когда основной буфер исчерпан, память берётся у upstream дополнительными
+    // буферами растущего размера вместо std::bad_alloc. Основной буфер по-прежнему
+    // проверяется первым, поэтому быстрый путь не меняется.
+    BasicFixedBufferResource(std::size_t size, std::pmr::memory_resource* upstream_resource)
+        : BasicFixedBufferResource(size) {
+        upstream = upstream_resource;
+        next_overflow_size = std::max(buffer_size, 64 * granule);
+    }
+
+    // Работает поверх буфера вызывающего (массив на стеке, разделяемая память и т.п.),
+    // не владея им; буфер должен пережить ресурс. Невыровненное начало пропускается.
+    // Состояние распределителя хранится в объекте, а не в буфере, поэтому блоки из
+    // разделяемой памяти может выдавать только один процесс.
+    BasicFixedBufferResource(void* storage, std::size_t size,
+                             std::pmr::memory_resource* upstream_resource = nullptr)
+        : ownership(Ownership::external) {
+        void* aligned = storage;
+        if (!std::align(granule, granule, aligned, size)) size = 0;
+        buffer = static_cast<char*>(aligned);
+        buffer_size = size / granule * granule;
+        if (buffer_size / granule >= npos) throw std::length_error("FixedBufferResource: buffer is too large");
+        init_buffer();
+        if (upstream_resource) {
+            upstream = upstream_resource;
+            next_overflow_size = std::max(buffer_size, 64 * granule);
+        }
+    }
+
+#if FIXED_BUFFER_HAS_MMAP
+    // Буфер из анонимного отображения. Сначала пробуем MAP_HUGETLB (размер округляется
+    // до 2 МиБ); если огромные страницы не настроены, берём обычное отображение и
+    // просим ядро о прозрачных огромных страницах через madvise. Отображение
+    // частное: списки свободных блоков и битовые карты живут в объекте ресурса,
+    // так что делить буфер между процессами он не умеет.
+    static BasicFixedBufferResource mapped(std::size_t size, bool use_huge_pages = true) {
+        constexpr std::size_t huge_page = 2 * 1024 * 1024;
+        void* p = MAP_FAILED;
+        std::size_t length = size;
+        bool huge = false;
+#ifdef MAP_HUGETLB
+        if (use_huge_pages) {
+            length = (size + huge_page - 1) / huge_page * huge_page;
+            p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            huge = p != MAP_FAILED;
+        }
+#endif
+        if (p == MAP_FAILED) {
+            length = size;
+            p = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+            if (use_huge_pages) ::madvise(p, length, MADV_HUGEPAGE);
+#endif
+        }
+
+        // Пока ресурс не принял отображение, освобождаем его сами.
+        try {
+            BasicFixedBufferResource resource(p, length);
+            resource.ownership = Ownership::mapping;
+            resource.mapping_size = length;
+            resource.huge_pages = huge;
+            return resource;
+        } catch (...) {
+            ::munmap(p, length);
+            throw;
+        }
+    }
+#endif
+
+    // true, если буфер получен через MAP_HUGETLB.
+    bool uses_huge_pages() const { return huge_pages; }
+
+    ~BasicFixedBufferResource() override {
+        free_storage();
+    }
+
+    // Возвращает весь буфер разом, не трогая выделенные блоки: они становятся
+    // недействительными. Очищаются только битовые карты до отметки used.
+    // Дополнительные буферы возвращаются upstream.
+    void release() noexcept {
+        if (!buffer) return;
+        if constexpr (Guard::enabled) {
+            this->quarantine_head = 0;
+            this->quarantined = 0;
+            detail::unpoison_memory(buffer, buffer_size);
+        }
+        if (upstream) free_overflow();
+        std::size_t words = (used / granule + 63) / 64;
+        std::memset(start_bits, 0, words * sizeof(std::uint64_t));
+        std::memset(end_bits, 0, words * sizeof(std::uint64_t));
+        free_bins.fill(npos);
+        nonempty_bins = 0;
+        used = meta_size;
+        this->on_release();
+    }
+
+    BasicFixedBufferResource(const BasicFixedBufferResource&) = delete;
+    BasicFixedBufferResource& operator=(const BasicFixedBufferResource&) = delete;
+    BasicFixedBufferResource(BasicFixedBufferResource&& other) noexcept {
+        steal(other);
+    }
+
+    BasicFixedBufferResource& operator=(BasicFixedBufferResource&& other) noexcept {
+        if (this != &other) {
+            free_storage();
+            steal(other);
+        }
+        return *this;
+    }
+
+    std::size_t overflow_buffers() const {
+        std::size_t n = 0;
+        for (Overflow* o = overflow; o; o = o->next) ++n;
+        return n;
+    }
+
+    std::size_t size() const { return buffer_size; }
+
+    // Невиртуальные входы для FixedBufferAllocator: вызов через конкретный тип ресурса
+    // встраивается в место вызова, тогда как memory_resource::allocate идёт через vtable.
+    void* allocate_block(std::size_t bytes, std::size_t alignment) {
+        return BasicFixedBufferResource::do_allocate(bytes, alignment);
+    }
+
+    void deallocate_block(void* p, std::size_t bytes, std::size_t alignment) {
+        BasicFixedBufferResource::do_deallocate(p, bytes, alignment);
+    }
+
+    // Доступно только с политикой AllocationGuard.
+    void set_guard_handler(GuardHandler handler) {
+        static_assert(Guard::enabled, "guard checks are disabled for this resource");
+        this->handler = handler;
+    }
+
+    std::size_t guard_errors() const {
+        static_assert(Guard::enabled, "guard checks are disabled for this resource");
+        return this->errors;
+    }
+
+    // Освобождает весь карантин с проверкой на запись после освобождения.
+    void flush_quarantine() {
+        static_assert(Guard::enabled, "guard checks are disabled for this resource");
+        while (this->quarantined) evict_quarantined();
+    }
+
+    // Доступно только с политикой AllocationStats.
+    const Stats& stats() const {
+        static_assert(Stats::enabled, "statistics are disabled for this resource");
+        return *this;
+    }
+
+    std::size_t free_list_length() const { return stats().free_blocks; }
+
+    // Доля свободной памяти, не входящая в наибольший свободный блок: 0 — вся свободная
+    // память непрерывна, ближе к 1 — раздроблена на мелкие куски.
+    double fragmentation() const {
+        std::size_t tail = buffer_size - used;
+        std::size_t total = stats().free_bytes + tail;
+        if (total == 0) return 0.0;
+        std::size_t largest = tail;
+        for (std::size_t bin = bin_count; bin-- > 0;) {
+            if (!(nonempty_bins >> bin & 1)) continue;
+            for (index_type i = free_bins[bin]; i != npos; i = header(i)->next) {
+                largest = std::max<std::size_t>(largest, header(i)->size * granule);
+            }
+            break;
+        }
+        return 1.0 - static_cast<double>(largest) / static_cast<double>(total);
+    }
+
+    void dump_stats_json(std::ostream& out) const {
+        const Stats& s = stats();
+        out << "{\"buffer_size\":" << buffer_size
+            << ",\"used\":" << used
+            << ",\"bytes_in_use\":" << s.bytes_in_use
+            << ",\"high_water_mark\":" << s.high_water_mark
+            << ",\"free_list_length\":" << s.free_blocks
+            << ",\"free_bytes\":" << s.free_bytes
+            << ",\"rounding_waste\":" << s.rounding_waste
+            << ",\"fragmentation\":" << fragmentation()
+            << ",\"allocations\":" << s.allocations
+            << ",\"deallocations\":" << s.deallocations
+            << ",\"allocated_bytes\":" << s.allocated_bytes
+            << ",\"deallocated_bytes\":" << s.deallocated_bytes
+            << ",\"size_histogram\":{";
+        bool first = true;
+        for (std::size_t i = 0; i < s.size_histogram.size(); ++i) {
+            if (!s.size_histogram[i]) continue;
+            out << (first ? "" : ",") << "\"" << (i ? std::size_t(1) << (i - 1) : 0) << "\":" << s.size_histogram[i];
+            first = false;
+        }
+        out << "}}";
+    }
+};
+
+#if STACK_CHECKED_RESOURCE
+using FixedBufferResource = BasicFixedBufferResource<NoAllocationStats, AllocationGuard>;
+#else
+using FixedBufferResource = BasicFixedBufferResource<>;
+#endif
+using InstrumentedFixedBufferResource = BasicFixedBufferResource<AllocationStats>;
+using CheckedFixedBufferResource = BasicFixedBufferResource<NoAllocationStats, AllocationGuard>;
+using TracedFixedBufferResource = BasicFixedBufferResource<NoAllocationStats, NoAllocationGuard, LatencyTracing>;
+
+namespace detail {
+
+// Ресурсы, принимающие выделенный блок обратно по частям (см. BasicFixedBufferResource).
+inline bool accepts_partial_deallocation(std::pmr::memory_resource* resource) {
+    auto* fixed = dynamic_cast<FixedBufferResourceBase*>(resource);
+    return fixed && fixed->accepts_partial_deallocation();
+}
+
+// Порядковый номер потока, выдаётся при первом обращении из потока.
+inline std::size_t thread_slot() {
+    static std::atomic<std::size_t> next_slot{0};
+    thread_local std::size_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+}
+
+// Потокобезопасный вариант FixedBufferResource. Буфер по-прежнему один и ограничен,
+// но мелкие блоки (до max_cached_granules гранул) проходят через thread_local кэши:
+// поток берёт и возвращает блоки в свой кэш без блокировок. Общий FixedBufferResource
+// под мьютексом затрагивается лишь при промахе (кэш пополняется пачкой блоков) или
+// переполнении (половина кэша возвращается). При выходе потока его кэш сливается
+// обратно в общий буфер и достаётся следующему потоку. Если общий буфер исчерпан,
+// другие потоки получают просьбу слить свои кэши при следующей операции; блоки
+// в кэше потока, который больше не обращается к ресурсу, до его выхода недоступны.
+// Кэши лежат в массиве из cached_threads ячеек, выделенном вместе с ресурсом, так
+// что первое обращение потока тоже не идёт в кучу; потоки сверх этого числа
+// работают с общим буфером напрямую.
+class ConcurrentFixedBufferResource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t granule = FixedBufferResource::granule;
+    static constexpr std::size_t max_cached_granules = 8;
+    static constexpr std::size_t cache_depth = 16;
+
+private:
+    // Кэш одного потока. blocks и counts трогает только поток-владелец (а также
+    // код, который держит central_mutex, когда владельца уже нет).
+    struct Cache {
+        std::array<std::array<void*, cache_depth>, max_cached_granules> blocks;
+        std::array<std::size_t, max_cached_granules> counts{};
+        std::atomic<bool> flush_requested{false};
+        bool orphaned = false;
+    };
+
+    // Живые ресурсы по номерам. Номер не переиспользуется, поэтому запись потока
+    // о давно удалённом ресурсе не спутать с новым ресурсом по тому же адресу.
+    struct Registry {
+        std::mutex mutex;
+        std::vector<std::pair<std::uint64_t, ConcurrentFixedBufferResource*>> live;
+        std::uint64_t next_id = 1;
+
+        ConcurrentFixedBufferResource* find(std::uint64_t id) const {
+            for (const auto& entry : live) {
+                if (entry.first == id) return entry.second;
+            }
+            return nullptr;
+        }
+    };
+
+    static Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    // Кэши потока во всех ресурсах, к которым он обращался (nullptr, если свободной
+    // ячейки не нашлось); последний — отдельно, чтобы в обычном случае поиск был
+    // одним сравнением.
+    struct ThreadCaches {
+        std::vector<std::pair<std::uint64_t, Cache*>> entries;
+        std::uint64_t last_id = 0;
+        Cache* last = nullptr;
+
+        ~ThreadCaches() {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            for (const auto& entry : entries) {
+                ConcurrentFixedBufferResource* resource = r.find(entry.first);
+                if (resource && entry.second) resource->retire(*entry.second);
+            }
+        }
+    };
+
+    static ThreadCaches& thread_caches() {
+        thread_local ThreadCaches caches;
+        return caches;
+    }
+
+    FixedBufferResource central;
+    std::mutex central_mutex;
+    std::unique_ptr<Cache[]> caches;
+    std::size_t cache_count;
+    // Сколько ячеек caches уже выдано потокам; каждая выданная либо занята, либо orphaned.
+    std::size_t caches_used = 0;
+    std::uint64_t id;
+
+    static std::size_t granules_for(std::size_t bytes) {
+        if (bytes > std::numeric_limits<std::size_t>::max() - granule) throw std::bad_alloc();
+        return bytes == 0 ? 1 : (bytes + granule - 1) / granule;
+    }
+
+    Cache* local_cache() {
+        ThreadCaches& tc = thread_caches();
+        if (tc.last_id == id) return tc.last;
+        return attach_cache(tc);
+    }
+
+    // Первое обращение потока к ресурсу (или переключение между ресурсами).
+    Cache* attach_cache(ThreadCaches& tc) {
+        for (const auto& entry : tc.entries) {
+            if (entry.first == id) {
+                tc.last_id = id;
+                tc.last = entry.second;
+                return entry.second;
+            }
+        }
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> registry_lock(r.mutex);
+        tc.entries.erase(std::remove_if(tc.entries.begin(), tc.entries.end(),
+                                        [&r](const auto& entry) { return !r.find(entry.first); }),
+                         tc.entries.end());
+        Cache* cache = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            for (std::size_t i = 0; i < caches_used; ++i) {
+                if (caches[i].orphaned) {
+                    caches[i].orphaned = false;
+                    cache = &caches[i];
+                    break;
+                }
+            }
+            if (!cache && caches_used < cache_count) cache = &caches[caches_used++];
+        }
+        tc.entries.emplace_back(id, cache);
+        tc.last_id = id;
+        tc.last = cache;
+        return cache;
+    }
+
+    // Возвращает в общий буфер блоки класса cls, оставляя в кэше keep штук.
+    // Вызывается под central_mutex.
+    void flush(Cache& cache, std::size_t cls, std::size_t keep) {
+        while (cache.counts[cls] > keep) {
+            central.deallocate(cache.blocks[cls][--cache.counts[cls]], (cls + 1) * granule, granule);
+        }
+    }
+
+    void flush_all(Cache& cache) {
+        cache.flush_requested.store(false, std::memory_order_relaxed);
+        for (std::size_t cls = 0; cls < max_cached_granules; ++cls) flush(cache, cls, 0);
+    }
+
+    // Поток завершился: его блоки возвращаются в буфер, а кэш — в запас ресурса.
+    void retire(Cache& cache) {
+        std::lock_guard<std::mutex> lock(central_mutex);
+        flush_all(cache);
+        cache.orphaned = true;
+    }
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        std::size_t n = granules_for(bytes);
+        if (alignment > granule || n > max_cached_granules) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            return central.allocate(bytes, alignment);
+        }
+
+        std::size_t cls = n - 1;
+        Cache* own = local_cache();
+        if (!own) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            return central.allocate(n * granule, granule);
+        }
+        Cache& cache = *own;
+        if (cache.flush_requested.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            flush_all(cache);
+        }
+        if (cache.counts[cls] > 0) return cache.blocks[cls][--cache.counts[cls]];
+
+        std::lock_guard<std::mutex> lock(central_mutex);
+        try {
+            while (cache.counts[cls] < cache_depth / 2) {
+                cache.blocks[cls][cache.counts[cls]++] = central.allocate(n * granule, granule);
+            }
+        } catch (const std::bad_alloc&) {
+        }
+        if (cache.counts[cls] > 0) return cache.blocks[cls][--cache.counts[cls]];
+
+        // Общий буфер исчерпан: сливаем свой кэш и просим о том же остальные потоки.
+        flush_all(cache);
+        for (std::size_t i = 0; i < caches_used; ++i) {
+            Cache& c = caches[i];
+            if (&c != &cache && !c.orphaned) c.flush_requested.store(true, std::memory_order_relaxed);
+        }
+        return central.allocate(n * granule, granule);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        if (!p) return;
+        std::size_t n = granules_for(bytes);
+        if (alignment > granule || n > max_cached_granules) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            central.deallocate(p, bytes, alignment);
+            return;
+        }
+
+        std::size_t cls = n - 1;
+        Cache* own = local_cache();
+        if (!own) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            central.deallocate(p, n * granule, granule);
+            return;
+        }
+        Cache& cache = *own;
+        if (cache.counts[cls] == cache_depth || cache.flush_requested.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(central_mutex);
+            if (cache.flush_requested.load(std::memory_order_relaxed)) flush_all(cache);
+            else flush(cache, cls, cache_depth / 2);
+        }
+        cache.blocks[cls][cache.counts[cls]++] = p;
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit ConcurrentFixedBufferResource(std::size_t size = 1024 * 1024,
+                                           std::size_t cached_threads = std::max(8u, 2 * std::thread::hardware_concurrency()))
+        : central(size), caches(new Cache[cached_threads]), cache_count(cached_threads) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        id = r.next_id++;
+        r.live.emplace_back(id, this);
+    }
+
+    ConcurrentFixedBufferResource(const ConcurrentFixedBufferResource&) = delete;
+    ConcurrentFixedBufferResource& operator=(const ConcurrentFixedBufferResource&) = delete;
+
+    // После снятия с учёта ни один выходящий поток уже не обратится к кэшам.
+    ~ConcurrentFixedBufferResource() override {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.erase(std::find(r.live.begin(), r.live.end(), std::make_pair(id, this)));
+    }
+
+    // Как FixedBufferResource::release(); вызывающий гарантирует, что другие потоки
+    // в этот момент ресурсом не пользуются.
+    void release() {
+        std::lock_guard<std::mutex> lock(central_mutex);
+        for (std::size_t i = 0; i < caches_used; ++i) {
+            caches[i].counts.fill(0);
+            caches[i].flush_requested.store(false, std::memory_order_relaxed);
+        }
+        central.release();
+    }
+};
+
+namespace detail {
+
+// Создаёт T с учётом протокола uses-allocator (аналог std::make_obj_using_allocator
+// из C++20): если T принимает аллокатор, он передаётся либо через allocator_arg,
+// либо последним аргументом. Возвращаемое значение материализуется сразу на месте.
+template<typename T, typename Alloc, typename... Args>
+T make_using_allocator(const Alloc& alloc, Args&&... args) {
+    if constexpr (!std::uses_allocator_v<T, Alloc>) {
+        return T(std::forward<Args>(args)...);
+    } else if constexpr (std::is_constructible_v<T, std::allocator_arg_t, const Alloc&, Args...>) {
+        return T(std::allocator_arg, alloc, std::forward<Args>(args)...);
+    } else {
+        return T(std::forward<Args>(args)..., alloc);
+    }
+}
+
+// Снимок Stack: заголовок и элементы от нижнего к верхнему одним сплошным блоком.
+// Байты пишутся как есть, в порядке байт машины: снимок предназначен для быстрого
+// перезапуска на той же платформе, а не для обмена.
+struct StackImageHeader {
+    std::uint32_t magic;
+    std::uint32_t element_size;
+    std::uint64_t count;
+};
+
+inline constexpr std::uint32_t stack_image_magic = 0x314B5453; // "STK1"
+
+template<typename T>
+void write_stack_image_header(std::ostream& out, std::size_t count) {
+    StackImageHeader header{stack_image_magic, static_cast<std::uint32_t>(sizeof(T)), count};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+// Проверяет заголовок снимка и возвращает число элементов в нём.
+template<typename T>
+std::size_t stack_image_count(const void* data, std::size_t size) {
+    StackImageHeader header;
+    if (size < sizeof(header)) throw std::runtime_error("Stack: truncated image header");
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != stack_image_magic || header.element_size != sizeof(T)) {
+        throw std::runtime_error("Stack: image does not match the element type");
+    }
+    if (header.count > (size - sizeof(header)) / sizeof(T)) throw std::runtime_error("Stack: truncated image");
+    return static_cast<std::size_t>(header.count);
+}
+
+// Читает снимок целиком, вместе с заголовком. Данные читаются кусками, и вектор
+// растёт по мере их поступления: испорченный счётчик в заголовке даёт runtime_error
+// на коротком чтении, а не выделение памяти под несуществующие элементы.
+template<typename T>
+std::vector<unsigned char> read_stack_image(std::istream& in) {
+    constexpr std::size_t chunk = 64 * 1024;
+    std::vector<unsigned char> image(sizeof(StackImageHeader));
+    if (!in.read(reinterpret_cast<char*>(image.data()), image.size())) {
+        throw std::runtime_error("Stack: truncated image header");
+    }
+    // stack_image_count ограничивает n так, что n * sizeof(T) + заголовок не переполняется
+    std::size_t n = stack_image_count<T>(image.data(), std::numeric_limits<std::size_t>::max());
+    std::size_t remaining = n * sizeof(T);
+    while (remaining > 0) {
+        std::size_t step = std::min(remaining, chunk);
+        std::size_t offset = image.size();
+        image.resize(offset + step);
+        if (!in.read(reinterpret_cast<char*>(image.data() + offset), step)) {
+            throw std::runtime_error("Stack: truncated image");
+        }
+        remaining -= step;
+    }
+    return image;
+}
+
+// Обходит элементы снимка, копируя каждый через memcpy: данные из файла или mmap
+// не обязаны быть выровнены под T.
+template<typename T>
+class StackImageIterator {
+    const unsigned char* p;
+
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = T;
+
+    explicit StackImageIterator(const unsigned char* bytes = nullptr) : p(bytes) {}
+
+    T operator*() const {
+        T value;
+        std::memcpy(static_cast<void*>(&value), p, sizeof(T));
+        return value;
+    }
+
+    StackImageIterator& operator++() {
+        p += sizeof(T);
+        return *this;
+    }
+
+    StackImageIterator operator++(int) {
+        StackImageIterator tmp = *this;
+        p += sizeof(T);
+        return tmp;
+    }
+
+    bool operator==(const StackImageIterator& other) const { return p == other.p; }
+    bool operator!=(const StackImageIterator& other) const { return p != other.p; }
+};
+
+}
+
+// Аллокатор, привязанный к конкретному типу ресурса. Stack<T, Storage,
+// FixedBufferAllocator<T>> обращается к FixedBufferResource без виртуальных вызовов,
+// и выделение узла встраивается в push/pop; с polymorphic_allocator (по умолчанию)
+// тот же стек работает с любым memory_resource. Элементам, принимающим
+// pmr-аллокатор, передаётся тот же ресурс (uses-allocator).
+template<typename T, typename Resource = FixedBufferResource>
+class FixedBufferAllocator {
+    Resource* arena;
+
+public:
+    using value_type = T;
+    // Можно ли возвращать блоки частями, см. BasicFixedBufferResource.
+    static constexpr bool partial_deallocation = Resource::partial_deallocation;
+
+    FixedBufferAllocator(Resource* r) noexcept : arena(r) {}
+
+    template<typename U>
+    FixedBufferAllocator(const FixedBufferAllocator<U, Resource>& other) noexcept : arena(other.resource()) {}
+
+    T* allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T*>(arena->allocate_block(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T* p, std::size_t n) { arena->deallocate_block(p, n * sizeof(T), alignof(T)); }
+
+    template<typename U, typename... Args>
+    void construct(U* p, Args&&... args) {
+        ::new (static_cast<void*>(p)) U(detail::make_using_allocator<U>(*this, std::forward<Args>(args)...));
+    }
+
+    template<typename U>
+    operator std::pmr::polymorphic_allocator<U>() const noexcept { return arena; }
+
+    Resource* resource() const noexcept { return arena; }
+
+    friend bool operator==(const FixedBufferAllocator& a, const FixedBufferAllocator& b) { return a.arena == b.arena; }
+    friend bool operator!=(const FixedBufferAllocator& a, const FixedBufferAllocator& b) { return a.arena != b.arena; }
+};
+
+namespace detail {
+
+// Можно ли освобождать часть блока, выделенного через этот аллокатор.
+template<typename U>
+bool allocator_accepts_partial_deallocation(const std::pmr::polymorphic_allocator<U>& alloc) {
+    return accepts_partial_deallocation(alloc.resource());
+}
+
+template<typename Alloc, typename = void>
+struct static_partial_deallocation : std::false_type {};
+
+template<typename Alloc>
+struct static_partial_deallocation<Alloc, std::void_t<decltype(Alloc::partial_deallocation)>>
+    : std::bool_constant<Alloc::partial_deallocation> {};
+
+template<typename Alloc>
+bool allocator_accepts_partial_deallocation(const Alloc&) {
+    return static_partial_deallocation<Alloc>::value;
+}
+
+}
+
+// Политики хранения элементов Stack: по узлу на элемент (по умолчанию)
+// или непрерывными блоками по ChunkSize элементов.
+struct NodeStorage {};
+
+template<std::size_t ChunkSize = 256>
+struct ChunkedStorage {
+    static_assert(ChunkSize > 0, "ChunkedStorage needs at least one element per chunk");
+};
+
+// Как NodeStorage, по узлу на элемент, но указатель next лежит перед значением: при обходе
+// читается начало узла, даже если большое T занимает несколько кэш-линий.
+// NodeAlignment > 0 дополнительно выравнивает каждый узел, например, на кэш-линию.
+template<std::size_t NodeAlignment = 0>
+struct LinkFirstStorage {
+    static_assert((NodeAlignment & (NodeAlignment - 1)) == 0, "node alignment must be a power of two");
+};
+
+namespace detail {
+
+template<typename Storage>
+struct node_layout;
+
+template<>
+struct node_layout<NodeStorage> {
+    static constexpr bool link_first = false;
+    static constexpr std::size_t alignment = 0;
+};
+
+template<std::size_t NodeAlignment>
+struct node_layout<LinkFirstStorage<NodeAlignment>> {
+    static constexpr bool link_first = true;
+    static constexpr std::size_t alignment = NodeAlignment;
+};
+
+inline void prefetch(const void* p) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(p, 0, 3);
+#else
+    (void)p;
+#endif
+}
+
+// Меньше стольких элементов на поток параллелить невыгодно.
+inline constexpr std::size_t parallel_grain = 4096;
+
+inline std::size_t parallel_threads(std::size_t requested, std::size_t items, std::size_t elements) {
+    std::size_t threads = requested ? requested : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, std::max<std::size_t>(1, elements / parallel_grain));
+    return std::min(threads, std::max<std::size_t>(1, items));
+}
+
+// Делит [0, items) на threads смежных отрезков и вызывает body(part, begin, end)
+// для каждого в своём потоке; последний отрезок обрабатывает вызывающий поток.
+// Первое исключение из body пробрасывается после завершения всех потоков.
+template<typename Body>
+void parallel_parts(std::size_t items, std::size_t threads, Body body) {
+    std::vector<std::exception_ptr> errors(threads);
+    auto run = [&](std::size_t part) {
+        try {
+            body(part, items * part / threads, items * (part + 1) / threads);
+        } catch (...) {
+            errors[part] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for (std::size_t part = 0; part + 1 < threads; ++part) workers.emplace_back(run, part);
+    run(threads - 1);
+    for (auto& worker : workers) worker.join();
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+}
+
+template<typename T, typename Storage = NodeStorage, typename Allocator = std::pmr::polymorphic_allocator<T>,
+         typename Tracer = NoTracing>
+class Stack {
+public:
+    using allocator_type = Allocator;
+    static_assert(std::is_same_v<typename std::allocator_traits<Allocator>::value_type, T>,
+                  "Stack allocator must allocate T");
+
+private:
+    using layout = detail::node_layout<Storage>;
+
+    struct Node;
+
+    struct NodeLink {
+        Node* next;
+    };
+
+    struct NodeValue {
+        T value;
+
+        template<typename... Args>
+        NodeValue(const allocator_type& alloc, Args&&... args)
+            : value(detail::make_using_allocator<T>(alloc, std::forward<Args>(args)...)) {}
+    };
+
+    // Порядок базовых классов задаёт порядок полей узла.
+    using first_part = std::conditional_t<layout::link_first, NodeLink, NodeValue>;
+    using second_part = std::conditional_t<layout::link_first, NodeValue, NodeLink>;
+
+    struct alignas(std::max({layout::alignment, alignof(NodeLink), alignof(NodeValue)})) Node : first_part, second_part {
+        template<typename... Args>
+        Node(Node* n, const allocator_type& alloc, Args&&... args)
+            : NodeValue(alloc, std::forward<Args>(args)...) {
+            this->next = n;
+        }
+    };
+
+    // Узлы запрашиваются через аллокатор, перепривязанный к Node, чтобы каждый push
+    // получал ровно sizeof(Node) байт с выравниванием alignof(Node).
+    using node_allocator = typename std::allocator_traits<allocator_type>::template rebind_alloc<Node>;
+    using node_traits = std::allocator_traits<node_allocator>;
+
+    Node* top_node = nullptr;
+    Node* bottom_node = nullptr;
+    std::size_t count = 0;
+    node_allocator alloc;
+    // Аллокатор стека не меняется после конструирования, поэтому ответ ресурса
+    // запоминается один раз.
+    bool bulk;
+
+    // Узлы можно выделять одним блоком и освобождать по одному, только если ресурс
+    // допускает возврат блока частями, как FixedBufferResource.
+    static bool bulk_capable_for(const node_allocator& a) {
+        if constexpr (sizeof(Node) % FixedBufferResource::granule != 0 ||
+                      alignof(Node) > FixedBufferResource::granule) {
+            return false;
+        } else {
+            return detail::allocator_accepts_partial_deallocation(a);
+        }
+    }
+
+    bool bulk_capable() const { return bulk; }
+
+    // Забирает узлы other; сам стек должен быть пуст.
+    void steal(Stack& other) noexcept {
+        top_node = other.top_node;
+        bottom_node = other.bottom_node;
+        count = other.count;
+        other.discard();
+    }
+
+    // Кладёт поверх своих элементов копии (или перемещённые элементы) other в том же
+    // порядке. При исключении стек остаётся в исходном состоянии, other не меняется.
+    template<bool Move, typename Source>
+    void append_elements(Source& other) {
+        std::vector<Node*> nodes;
+        nodes.reserve(other.count);
+        for (Node* node = other.top_node; node; node = node->next) nodes.push_back(node);
+        std::size_t pushed = 0;
+        try {
+            for (auto it = nodes.rbegin(); it != nodes.rend(); ++it, ++pushed) {
+                if constexpr (Move) emplace(std::move((*it)->value));
+                else emplace((*it)->value);
+            }
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+public:
+    static constexpr std::size_t node_size = sizeof(Node);
+    static constexpr std::size_t node_alignment = alignof(Node);
+
+    explicit Stack(const allocator_type& a = allocator_type())
+        : alloc(a), bulk(bulk_capable_for(alloc)) {}
+
+    // Копия, как и у стандартных pmr-контейнеров, получает ресурс по умолчанию.
+    Stack(const Stack& other)
+        : Stack(other, std::allocator_traits<allocator_type>::select_on_container_copy_construction(
+                           other.get_allocator())) {}
+
+    Stack(const Stack& other, const allocator_type& a)
+        : alloc(a), bulk(bulk_capable_for(alloc)) {
+        append_elements<false>(other);
+    }
+
+    // Узлы забираются целиком, без обращений к ресурсу.
+    Stack(Stack&& other) noexcept
+        : alloc(other.alloc), bulk(other.bulk) {
+        steal(other);
+    }
+
+    // Узлы другого ресурса забрать нельзя, тогда элементы перемещаются по одному.
+    Stack(Stack&& other, const allocator_type& a)
+        : alloc(a), bulk(bulk_capable_for(alloc)) {
+        if (alloc == other.alloc) {
+            steal(other);
+        } else {
+            append_elements<true>(other);
+            other.clear();
+        }
+    }
+
+    // При присваивании ресурс стека не меняется: polymorphic_allocator не распространяется.
+    Stack& operator=(const Stack& other) {
+        if (this != &other) {
+            Stack copy(other, get_allocator());
+            clear();
+            steal(copy);
+        }
+        return *this;
+    }
+
+    Stack& operator=(Stack&& other) {
+        if (this != &other) {
+            clear();
+            if (alloc == other.alloc) {
+                steal(other);
+            } else {
+                append_elements<true>(other);
+                other.clear();
+            }
+        }
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return allocator_type(alloc); }
+
+    // При равных ресурсах — обмен указателями, иначе элементы перемещаются поэлементно.
+    void swap(Stack& other) {
+        if (alloc == other.alloc) {
+            std::swap(top_node, other.top_node);
+            std::swap(bottom_node, other.bottom_node);
+            std::swap(count, other.count);
+            return;
+        }
+        Stack mine(std::move(*this), other.get_allocator());
+        *this = std::move(other);
+        other.steal(mine);
+    }
+
+    // Кладёт все элементы other поверх своих (верхний элемент other становится верхним),
+    // other становится пустым. При равных ресурсах узлы просто перецепляются за O(1).
+    void splice(Stack& other) {
+        if (this == &other || other.empty()) return;
+        if (alloc != other.alloc) {
+            append_elements<true>(other);
+            other.clear();
+            return;
+        }
+        other.bottom_node->next = top_node;
+        if (!top_node) bottom_node = other.bottom_node;
+        top_node = other.top_node;
+        count += other.count;
+        other.discard();
+    }
+
+    ~Stack() {
+        clear();
+    }
+
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+        detail::TraceScope<Tracer> trace(TraceEvent::push, 1);
+        Node* new_node = alloc.allocate(1);
+        try {
+            node_traits::construct(alloc, new_node, top_node, get_allocator(), std::forward<Args>(args)...);
+        } catch (...) {
+            alloc.deallocate(new_node, 1);
+            throw;
+        }
+        if (!top_node) bottom_node = new_node;
+        top_node = new_node;
+        ++count;
+        return new_node->value;
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    // Для прямых итераторов над FixedBufferResource все узлы берутся одним вызовом
+    // allocate, если в буфере есть место подряд. При исключении стек остаётся в
+    // исходном состоянии.
+    template<typename InputIt>
+    void push_range(InputIt first, InputIt last) {
+        detail::TraceScope<Tracer> trace(TraceEvent::push_range, detail::traced_range_size<Tracer>(first, last));
+        using category = typename std::iterator_traits<InputIt>::iterator_category;
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+            if (bulk_capable()) {
+                std::size_t n = static_cast<std::size_t>(std::distance(first, last));
+                if (n == 0) return;
+                // Во фрагментированном буфере n узлов подряд может не найтись,
+                // хотя по одному они помещаются.
+                Node* nodes = nullptr;
+                try {
+                    nodes = alloc.allocate(n);
+                } catch (const std::bad_alloc&) {
+                }
+                if (nodes) {
+                    Node* below = top_node;
+                    std::size_t built = 0;
+                    try {
+                        for (; built < n; ++built, ++first) {
+                            node_traits::construct(alloc, nodes + built, below, get_allocator(), *first);
+                            below = nodes + built;
+                        }
+                    } catch (...) {
+                        while (built > 0) node_traits::destroy(alloc, nodes + --built);
+                        alloc.deallocate(nodes, n);
+                        throw;
+                    }
+                    if (!top_node) bottom_node = nodes;
+                    top_node = below;
+                    count += n;
+                    return;
+                }
+            }
+        }
+        std::size_t pushed = 0;
+        try {
+            for (; first != last; ++first, ++pushed) emplace(*first);
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+    // Снимает до n элементов. Узлы, лежащие в памяти подряд, возвращаются ресурсу
+    // одним вызовом deallocate.
+    std::size_t pop_n(std::size_t n) {
+        n = std::min(n, count);
+        if (n == 0) return 0;
+        detail::TraceScope<Tracer> trace(TraceEvent::pop_n, n);
+        if (!bulk_capable()) {
+            for (std::size_t i = 0; i < n; ++i) pop();
+            return n;
+        }
+        Node* run = nullptr;
+        std::size_t run_length = 0;
+        for (std::size_t i = 0; i < n; ++i) {
+            Node* old = top_node;
+            top_node = top_node->next;
+            if constexpr (!std::is_trivially_destructible_v<T>) node_traits::destroy(alloc, old);
+            if (run && reinterpret_cast<char*>(old) + sizeof(Node) == reinterpret_cast<char*>(run)) {
+                run = old;
+                ++run_length;
+            } else {
+                if (run) alloc.deallocate(run, run_length);
+                run = old;
+                run_length = 1;
+            }
+        }
+        if (run) alloc.deallocate(run, run_length);
+        if (!top_node) bottom_node = nullptr;
+        count -= n;
+        return n;
+    }
+
+    void pop() {
+        if (!top_node) return;
+        detail::TraceScope<Tracer> trace(TraceEvent::pop, 1);
+        Node* old = top_node;
+
+        top_node = top_node->next;
+        if (!top_node) bottom_node = nullptr;
+
+        node_traits::destroy(alloc, old);
+
+        alloc.deallocate(old, 1);
+        --count;
+    }
+
+    T& top() {
+        assert(top_node);
+        return top_node->value;
+    }
+
+    const T& top() const {
+        assert(top_node);
+        return top_node->value;
+    }
+
+    bool empty() const { return top_node == nullptr; }
+    void clear() {
+        pop_n(count);
+    }
+
+    // Забывает все элементы, не вызывая деструкторов и не возвращая память ресурсу.
+    // Нужен вместе с FixedBufferResource::release(), когда арена сбрасывается целиком.
+    void discard() noexcept {
+        top_node = nullptr;
+        bottom_node = nullptr;
+        count = 0;
+    }
+
+    std::size_t size() const { return count; }
+
+    // Копирует элементы в out (там должно быть size() элементов) в порядке push —
+    // от нижнего к верхнему, так что push_range(out, out + size()) воспроизводит стек.
+    T* copy_to(T* out) const {
+        T* pos = out + count;
+        for (Node* node = top_node; node; node = node->next) *--pos = node->value;
+        return out + count;
+    }
+
+    // Снимок в формате detail::StackImageHeader; элементы собираются в один блок
+    // и пишутся одним вызовом write.
+    void serialize(std::ostream& out) const {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable elements can be serialized");
+        detail::write_stack_image_header<T>(out, count);
+        std::vector<unsigned char> image(count * sizeof(T));
+        std::size_t i = count;
+        for (Node* node = top_node; node; node = node->next) {
+            std::memcpy(image.data() + --i * sizeof(T), static_cast<const void*>(&node->value), sizeof(T));
+        }
+        out.write(reinterpret_cast<const char*>(image.data()), image.size());
+    }
+
+    void deserialize(std::istream& in) {
+        std::vector<unsigned char> image = detail::read_stack_image<T>(in);
+        deserialize(image.data(), image.size());
+    }
+
+    // Заменяет содержимое стека снимком из памяти, например отображённого через mmap
+    // файла, без промежуточной копии. Над FixedBufferResource все узлы берутся одним
+    // вызовом allocate. Негодный снимок отвергается до изменения стека; если же
+    // исключение возникло при выделении памяти, стек остаётся пустым.
+    void deserialize(const void* data, std::size_t size) {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable elements can be serialized");
+        std::size_t n = detail::stack_image_count<T>(data, size);
+        const unsigned char* elements = static_cast<const unsigned char*>(data) + sizeof(detail::StackImageHeader);
+        clear();
+        push_range(detail::StackImageIterator<T>(elements), detail::StackImageIterator<T>(elements + n * sizeof(T)));
+    }
+
+    // При Distance > 0 итератор держит указатель на Distance узлов впереди текущего
+    // и заранее запрашивает этот узел и его значение в кэш, так что переход
+    // к следующему элементу реже ждёт память.
+    template<std::size_t Distance>
+    class basic_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+    private:
+        Node* current;
+        Node* ahead;
+
+        static void prefetch_node(const Node* node) {
+            detail::prefetch(node);
+            const char* value = reinterpret_cast<const char*>(&node->value);
+            for (std::size_t line = 64; line < sizeof(T); line += 64) detail::prefetch(value + line);
+        }
+
+    public:
+        explicit basic_iterator(Node* node = nullptr) : current(node), ahead(node) {
+            if constexpr (Distance > 0) {
+                for (std::size_t i = 0; i < Distance && ahead; ++i) {
+                    ahead = ahead->next;
+                    if (ahead) prefetch_node(ahead);
+                }
+            }
+        }
+
+        reference operator*() const { return current->value; }
+        pointer operator->() const { return &(current->value); }
+
+        basic_iterator& operator++() {
+            current = current->next;
+            if constexpr (Distance > 0) {
+                if (ahead) {
+                    ahead = ahead->next;
+                    if (ahead) prefetch_node(ahead);
+                }
+            }
+            return *this;
+        }
+
+        basic_iterator operator++(int) {
+            basic_iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const basic_iterator& other) const { return current == other.current; }
+        bool operator!=(const basic_iterator& other) const { return !(*this == other); }
+    };
+
+    using iterator = basic_iterator<0>;
+
+    iterator begin() { return iterator(top_node); }
+    iterator end() { return iterator(nullptr); }
+
+    template<std::size_t Distance>
+    struct prefetch_range {
+        Node* top;
+
+        basic_iterator<Distance> begin() const { return basic_iterator<Distance>(top); }
+        basic_iterator<Distance> end() const { return basic_iterator<Distance>(nullptr); }
+    };
+
+    // for (auto& x : stack.prefetched<8>()) — обход с упреждающей загрузкой узлов.
+    template<std::size_t Distance = 4>
+    prefetch_range<Distance> prefetched() { return {top_node}; }
+
+    // Вызывает f для каждого элемента из нескольких потоков (threads = 0 — по числу
+    // ядер); порядок вызовов не определён. Узлы сначала собираются в индекс одним
+    // проходом, который затем делится между потоками поровну.
+    template<typename F>
+    void parallel_for_each(F f, std::size_t threads = 0) {
+        std::vector<Node*> index = node_index();
+        threads = detail::parallel_threads(threads, index.size(), index.size());
+        detail::parallel_parts(index.size(), threads, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; ++i) f(index[i]->value);
+        });
+    }
+
+    // Как std::transform_reduce: reduce должна быть ассоциативной и коммутативной.
+    template<typename R, typename Reduce, typename Transform>
+    R transform_reduce(R init, Reduce reduce, Transform transform, std::size_t threads = 0) {
+        std::vector<Node*> index = node_index();
+        threads = detail::parallel_threads(threads, index.size(), index.size());
+        std::vector<std::optional<R>> partial(threads);
+        detail::parallel_parts(index.size(), threads, [&](std::size_t part, std::size_t begin, std::size_t end) {
+            if (begin == end) return;
+            R acc = transform(index[begin]->value);
+            for (std::size_t i = begin + 1; i < end; ++i) acc = reduce(std::move(acc), transform(index[i]->value));
+            partial[part] = std::move(acc);
+        });
+        for (auto& p : partial) {
+            if (p) init = reduce(std::move(init), std::move(*p));
+        }
+        return init;
+    }
+
+private:
+    std::vector<Node*> node_index() const {
+        std::vector<Node*> index;
+        index.reserve(count);
+        for (Node* node = top_node; node; node = node->next) index.push_back(node);
+        return index;
+    }
+};
+
+// Элементы лежат подряд в блоках по ChunkSize штук, блоки связаны от верхнего к нижнему.
+// push/pop сдвигают счётчик верхнего блока; одна освобождённая ячейка-блок держится
+// про запас, чтобы push/pop на границе блока не гоняли память туда-обратно.
+template<typename T, std::size_t ChunkSize, typename Allocator, typename Tracer>
+class Stack<T, ChunkedStorage<ChunkSize>, Allocator, Tracer> {
+public:
+    using allocator_type = Allocator;
+    static constexpr std::size_t chunk_capacity = ChunkSize;
+
+private:
+    struct Chunk {
+        Chunk* prev;
+        std::size_t count;
+        alignas(T) unsigned char storage[sizeof(T) * ChunkSize];
+
+        T* data() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+    using chunk_allocator = typename std::allocator_traits<allocator_type>::template rebind_alloc<Chunk>;
+
+    Chunk* top_chunk = nullptr;
+    Chunk* bottom_chunk = nullptr;
+    Chunk* spare_chunk = nullptr;
+    std::size_t count = 0;
+    allocator_type alloc;
+
+    Chunk* acquire_chunk() {
+        Chunk* chunk = spare_chunk;
+        if (chunk) {
+            spare_chunk = nullptr;
+        } else {
+            chunk_allocator chunk_alloc(alloc);
+            chunk = ::new (static_cast<void*>(chunk_alloc.allocate(1))) Chunk;
+        }
+        chunk->prev = nullptr;
+        chunk->count = 0;
+        return chunk;
+    }
+
+    void release_chunk(Chunk* chunk) {
+        if (!spare_chunk) {
+            spare_chunk = chunk;
+            return;
+        }
+        chunk_allocator chunk_alloc(alloc);
+        chunk_alloc.deallocate(chunk, 1);
+    }
+
+    Chunk* top_chunk_with_room() {
+        Chunk* chunk = top_chunk;
+        if (!chunk || chunk->count == ChunkSize) chunk = acquire_chunk();
+        return chunk;
+    }
+
+    void link_chunk(Chunk* chunk) {
+        chunk->prev = top_chunk;
+        if (!top_chunk) bottom_chunk = chunk;
+        top_chunk = chunk;
+    }
+
+    void push_trivial(const T* source, std::size_t n) {
+        std::size_t pushed = 0;
+        try {
+            while (pushed < n) {
+                Chunk* chunk = top_chunk_with_room();
+                std::size_t k = std::min(n - pushed, ChunkSize - chunk->count);
+                std::memcpy(static_cast<void*>(chunk->data() + chunk->count), source + pushed, k * sizeof(T));
+                if (chunk != top_chunk) link_chunk(chunk);
+                chunk->count += k;
+                count += k;
+                pushed += k;
+            }
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+    void free_spare_chunk() {
+        if (spare_chunk) {
+            chunk_allocator chunk_alloc(alloc);
+            chunk_alloc.deallocate(spare_chunk, 1);
+            spare_chunk = nullptr;
+        }
+    }
+
+    // Забирает блоки other, кроме запасного; сам стек должен быть пуст.
+    void steal(Stack& other) noexcept {
+        top_chunk = other.top_chunk;
+        bottom_chunk = other.bottom_chunk;
+        count = other.count;
+        other.top_chunk = nullptr;
+        other.bottom_chunk = nullptr;
+        other.count = 0;
+    }
+
+    // См. Stack<T>::append_elements().
+    template<bool Move, typename Source>
+    void append_elements(Source& other) {
+        std::vector<Chunk*> chunks;
+        for (Chunk* chunk = other.top_chunk; chunk; chunk = chunk->prev) chunks.push_back(chunk);
+        std::size_t pushed = 0;
+        try {
+            for (auto it = chunks.rbegin(); it != chunks.rend(); ++it) {
+                for (std::size_t i = 0; i < (*it)->count; ++i, ++pushed) {
+                    if constexpr (Move) emplace(std::move((*it)->data()[i]));
+                    else emplace((*it)->data()[i]);
+                }
+            }
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+public:
+    explicit Stack(const allocator_type& a = allocator_type())
+        : alloc(a) {}
+
+    Stack(const Stack& other)
+        : Stack(other, std::allocator_traits<allocator_type>::select_on_container_copy_construction(
+                           other.get_allocator())) {}
+
+    Stack(const Stack& other, const allocator_type& a)
+        : alloc(a) {
+        try {
+            append_elements<false>(other);
+        } catch (...) {
+            free_spare_chunk();
+            throw;
+        }
+    }
+
+    Stack(Stack&& other) noexcept
+        : spare_chunk(other.spare_chunk), alloc(other.alloc) {
+        other.spare_chunk = nullptr;
+        steal(other);
+    }
+
+    Stack(Stack&& other, const allocator_type& a)
+        : alloc(a) {
+        if (alloc == other.alloc) {
+            steal(other);
+            return;
+        }
+        try {
+            append_elements<true>(other);
+        } catch (...) {
+            free_spare_chunk();
+            throw;
+        }
+        other.clear();
+    }
+
+    Stack& operator=(const Stack& other) {
+        if (this != &other) {
+            Stack copy(other, get_allocator());
+            clear();
+            steal(copy);
+        }
+        return *this;
+    }
+
+    Stack& operator=(Stack&& other) {
+        if (this != &other) {
+            clear();
+            if (alloc == other.alloc) {
+                steal(other);
+            } else {
+                append_elements<true>(other);
+                other.clear();
+            }
+        }
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return alloc; }
+
+    ~Stack() {
+        clear();
+        free_spare_chunk();
+    }
+
+    void swap(Stack& other) {
+        if (alloc == other.alloc) {
+            std::swap(top_chunk, other.top_chunk);
+            std::swap(bottom_chunk, other.bottom_chunk);
+            std::swap(count, other.count);
+            return;
+        }
+        Stack mine(std::move(*this), other.get_allocator());
+        *this = std::move(other);
+        other.steal(mine);
+    }
+
+    // Блоки other перецепляются поверх своих без копирования; неполный верхний блок
+    // этого стека остаётся в середине цепочки, новые push идут в верхний блок other.
+    void splice(Stack& other) {
+        if (this == &other || other.empty()) return;
+        if (alloc != other.alloc) {
+            append_elements<true>(other);
+            other.clear();
+            return;
+        }
+        other.bottom_chunk->prev = top_chunk;
+        if (!top_chunk) bottom_chunk = other.bottom_chunk;
+        top_chunk = other.top_chunk;
+        count += other.count;
+        other.top_chunk = nullptr;
+        other.bottom_chunk = nullptr;
+        other.count = 0;
+    }
+
+    // polymorphic_allocator::construct (как и FixedBufferAllocator::construct) сам
+    // выполняет uses-allocator конструирование.
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+        detail::TraceScope<Tracer> trace(TraceEvent::push, 1);
+        Chunk* chunk = top_chunk_with_room();
+        T* slot = chunk->data() + chunk->count;
+        try {
+            std::allocator_traits<allocator_type>::construct(alloc, slot, std::forward<Args>(args)...);
+        } catch (...) {
+            if (chunk != top_chunk) release_chunk(chunk);
+            throw;
+        }
+        if (chunk != top_chunk) link_chunk(chunk);
+        ++chunk->count;
+        ++count;
+        return *slot;
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    // Память берётся у ресурса не чаще раза на ChunkSize элементов. Диапазон из
+    // указателей на тривиально копируемые T копируется в блоки через memcpy.
+    // При исключении стек остаётся в исходном состоянии.
+    template<typename InputIt>
+    void push_range(InputIt first, InputIt last) {
+        detail::TraceScope<Tracer> trace(TraceEvent::push_range, detail::traced_range_size<Tracer>(first, last));
+        if constexpr (std::is_trivially_copyable_v<T> && std::is_pointer_v<InputIt> &&
+                      std::is_same_v<std::remove_cv_t<std::remove_pointer_t<InputIt>>, T>) {
+            push_trivial(first, static_cast<std::size_t>(last - first));
+        } else {
+            std::size_t pushed = 0;
+            try {
+                for (; first != last; ++first, ++pushed) emplace(*first);
+            } catch (...) {
+                pop_n(pushed);
+                throw;
+            }
+        }
+    }
+
+    // Снимает элементы поблочно; для тривиально разрушаемых T деструкторы не вызываются.
+    std::size_t pop_n(std::size_t n) {
+        n = std::min(n, count);
+        if (n == 0) return 0;
+        detail::TraceScope<Tracer> trace(TraceEvent::pop_n, n);
+        for (std::size_t left = n; left > 0;) {
+            Chunk* chunk = top_chunk;
+            std::size_t k = std::min(left, chunk->count);
+            if constexpr (!std::is_trivially_destructible_v<T>) {
+                for (std::size_t i = 0; i < k; ++i) {
+                    std::allocator_traits<allocator_type>::destroy(alloc, chunk->data() + --chunk->count);
+                }
+            } else {
+                chunk->count -= k;
+            }
+            if (chunk->count == 0) {
+                top_chunk = chunk->prev;
+                release_chunk(chunk);
+            }
+            left -= k;
+        }
+        if (!top_chunk) bottom_chunk = nullptr;
+        count -= n;
+        return n;
+    }
+
+    void pop() {
+        if (!top_chunk) return;
+        detail::TraceScope<Tracer> trace(TraceEvent::pop, 1);
+        Chunk* chunk = top_chunk;
+        std::allocator_traits<allocator_type>::destroy(alloc, chunk->data() + --chunk->count);
+        if (chunk->count == 0) {
+            top_chunk = chunk->prev;
+            if (!top_chunk) bottom_chunk = nullptr;
+            release_chunk(chunk);
+        }
+        --count;
+    }
+
+    T& top() {
+        assert(top_chunk);
+        return top_chunk->data()[top_chunk->count - 1];
+    }
+
+    const T& top() const {
+        assert(top_chunk);
+        return top_chunk->data()[top_chunk->count - 1];
+    }
+
+    bool empty() const { return top_chunk == nullptr; }
+    void clear() {
+        pop_n(count);
+    }
+
+    // См. Stack<T>::discard(): запасной блок тоже считается принадлежащим арене.
+    void discard() noexcept {
+        top_chunk = nullptr;
+        bottom_chunk = nullptr;
+        spare_chunk = nullptr;
+        count = 0;
+    }
+
+    std::size_t size() const { return count; }
+
+    // См. Stack<T>::copy_to(). Для тривиально копируемых T каждый блок копируется
+    // одним memcpy.
+    T* copy_to(T* out) const {
+        T* pos = out + count;
+        for (Chunk* chunk = top_chunk; chunk; chunk = chunk->prev) {
+            pos -= chunk->count;
+            if constexpr (std::is_trivially_copyable_v<T>) {
+                std::memcpy(static_cast<void*>(pos), chunk->data(), chunk->count * sizeof(T));
+            } else {
+                std::copy(chunk->data(), chunk->data() + chunk->count, pos);
+            }
+        }
+        return out + count;
+    }
+
+    // Формат тот же, что у Stack<T>; снимки двух видов хранения взаимозаменяемы.
+    // Блоки пишутся от нижнего к верхнему, каждый одним вызовом write.
+    void serialize(std::ostream& out) const {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable elements can be serialized");
+        detail::write_stack_image_header<T>(out, count);
+        std::vector<Chunk*> chunks;
+        for (Chunk* chunk = top_chunk; chunk; chunk = chunk->prev) chunks.push_back(chunk);
+        for (auto it = chunks.rbegin(); it != chunks.rend(); ++it) {
+            out.write(reinterpret_cast<const char*>((*it)->storage), (*it)->count * sizeof(T));
+        }
+    }
+
+    void deserialize(std::istream& in) {
+        std::vector<unsigned char> image = detail::read_stack_image<T>(in);
+        deserialize(image.data(), image.size());
+    }
+
+    // Элементы копируются в блоки через memcpy, по одному выделению на ChunkSize
+    // элементов. Исключения — как у Stack<T>::deserialize.
+    void deserialize(const void* data, std::size_t size) {
+        static_assert(std::is_trivially_copyable_v<T>, "only trivially copyable elements can be serialized");
+        std::size_t n = detail::stack_image_count<T>(data, size);
+        const unsigned char* elements = static_cast<const unsigned char*>(data) + sizeof(detail::StackImageHeader);
+        clear();
+        try {
+            while (n > 0) {
+                Chunk* chunk = acquire_chunk();
+                std::size_t k = std::min(n, ChunkSize);
+                std::memcpy(chunk->storage, elements, k * sizeof(T));
+                chunk->count = k;
+                link_chunk(chunk);
+                count += k;
+                elements += k * sizeof(T);
+                n -= k;
+            }
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+    private:
+        Chunk* chunk;
+        std::size_t index;
+
+    public:
+        explicit iterator(Chunk* c = nullptr) : chunk(c), index(c ? c->count : 0) {}
+
+        reference operator*() const { return chunk->data()[index - 1]; }
+        pointer operator->() const { return chunk->data() + index - 1; }
+
+        iterator& operator++() {
+            if (--index == 0) {
+                chunk = chunk->prev;
+                index = chunk ? chunk->count : 0;
+            }
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const { return chunk == other.chunk && index == other.index; }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+    };
+
+    iterator begin() { return iterator(top_chunk); }
+    iterator end() { return iterator(nullptr); }
+
+    // См. Stack<T>::parallel_for_each(). Между потоками делятся целые блоки, так что
+    // каждый поток проходит свои элементы подряд в памяти.
+    template<typename F>
+    void parallel_for_each(F f, std::size_t threads = 0) {
+        std::vector<Chunk*> chunks = chunk_index();
+        threads = detail::parallel_threads(threads, chunks.size(), count);
+        detail::parallel_parts(chunks.size(), threads, [&](std::size_t, std::size_t begin, std::size_t end) {
+            for (std::size_t c = begin; c < end; ++c) {
+                T* data = chunks[c]->data();
+                for (std::size_t i = 0; i < chunks[c]->count; ++i) f(data[i]);
+            }
+        });
+    }
+
+    template<typename R, typename Reduce, typename Transform>
+    R transform_reduce(R init, Reduce reduce, Transform transform, std::size_t threads = 0) {
+        std::vector<Chunk*> chunks = chunk_index();
+        threads = detail::parallel_threads(threads, chunks.size(), count);
+        std::vector<std::optional<R>> partial(threads);
+        detail::parallel_parts(chunks.size(), threads, [&](std::size_t part, std::size_t begin, std::size_t end) {
+            std::optional<R> acc;
+            for (std::size_t c = begin; c < end; ++c) {
+                T* data = chunks[c]->data();
+                R chunk_acc = transform(data[0]);
+                for (std::size_t i = 1; i < chunks[c]->count; ++i) chunk_acc = reduce(std::move(chunk_acc), transform(data[i]));
+                acc = acc ? reduce(std::move(*acc), std::move(chunk_acc)) : std::move(chunk_acc);
+            }
+            partial[part] = std::move(acc);
+        });
+        for (auto& p : partial) {
+            if (p) init = reduce(std::move(init), std::move(*p));
+        }
+        return init;
+    }
+
+private:
+    std::vector<Chunk*> chunk_index() const {
+        std::vector<Chunk*> chunks;
+        for (Chunk* chunk = top_chunk; chunk; chunk = chunk->prev) chunks.push_back(chunk);
+        return chunks;
+    }
+};
+
+template<typename T, typename Storage, typename Allocator, typename Tracer>
+void swap(Stack<T, Storage, Allocator, Tracer>& a, Stack<T, Storage, Allocator, Tracer>& b) {
+    a.swap(b);
+}
+
+// Стек ёмкостью N без аллокатора: элементы лежат в выровненном массиве внутри
+// объекта, push и pop не обращаются ни к какому ресурсу. При переполнении бросается
+// std::bad_alloc, как у ConcurrentStack. Итератор идёт от верхнего элемента к нижнему.
+template<typename T, std::size_t N>
+class StaticStack {
+    static_assert(N > 0, "StaticStack needs room for at least one element");
+
+    alignas(T) unsigned char storage[sizeof(T) * N];
+    std::size_t count = 0;
+
+    T* data() { return std::launder(reinterpret_cast<T*>(storage)); }
+    const T* data() const { return std::launder(reinterpret_cast<const T*>(storage)); }
+
+    // Конструирует элемент прямо из результата make() без промежуточного перемещения;
+    // через него SmallStack передаёт элементам свой аллокатор.
+    template<typename Make>
+    T& emplace_from(Make&& make) {
+        if (count == N) throw std::bad_alloc();
+        T* slot = data() + count;
+        ::new (static_cast<void*>(slot)) T(make());
+        ++count;
+        return *slot;
+    }
+
+    template<typename U, std::size_t M>
+    friend class SmallStack;
+
+public:
+    using iterator = std::reverse_iterator<T*>;
+
+    StaticStack() = default;
+
+    StaticStack(const StaticStack& other) {
+        try {
+            for (std::size_t i = 0; i < other.count; ++i) emplace(other.data()[i]);
+        } catch (...) {
+            clear();
+            throw;
+        }
+    }
+
+    // Элементы перемещаются по одному, other становится пустым.
+    StaticStack(StaticStack&& other) noexcept(std::is_nothrow_move_constructible_v<T>) {
+        try {
+            for (std::size_t i = 0; i < other.count; ++i) emplace(std::move(other.data()[i]));
+        } catch (...) {
+            clear();
+            throw;
+        }
+        other.clear();
+    }
+
+    StaticStack& operator=(const StaticStack& other) {
+        if (this != &other) {
+            clear();
+            for (std::size_t i = 0; i < other.count; ++i) emplace(other.data()[i]);
+        }
+        return *this;
+    }
+
+    StaticStack& operator=(StaticStack&& other) {
+        if (this != &other) {
+            clear();
+            for (std::size_t i = 0; i < other.count; ++i) emplace(std::move(other.data()[i]));
+            other.clear();
+        }
+        return *this;
+    }
+
+    ~StaticStack() {
+        clear();
+    }
+
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+        if (count == N) throw std::bad_alloc();
+        T* slot = data() + count;
+        ::new (static_cast<void*>(slot)) T(std::forward<Args>(args)...);
+        ++count;
+        return *slot;
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    // При исключении, в том числе при переполнении, стек остаётся в исходном состоянии.
+    template<typename InputIt>
+    void push_range(InputIt first, InputIt last) {
+        std::size_t pushed = 0;
+        try {
+            for (; first != last; ++first, ++pushed) emplace(*first);
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+    std::size_t pop_n(std::size_t n) {
+        n = std::min(n, count);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            for (std::size_t i = 0; i < n; ++i) std::destroy_at(data() + count - 1 - i);
+        }
+        count -= n;
+        return n;
+    }
+
+    void pop() {
+        if (count == 0) return;
+        std::destroy_at(data() + --count);
+    }
+
+    T& top() {
+        assert(count > 0);
+        return data()[count - 1];
+    }
+
+    const T& top() const {
+        assert(count > 0);
+        return data()[count - 1];
+    }
+
+    bool empty() const { return count == 0; }
+    bool full() const { return count == N; }
+    void clear() {
+        pop_n(count);
+    }
+
+    std::size_t size() const { return count; }
+    static constexpr std::size_t capacity() { return N; }
+
+    iterator begin() { return iterator(data() + count); }
+    iterator end() { return iterator(data()); }
+};
+
+// Первые N элементов лежат внутри объекта, следующие — в Stack<T, ChunkedStorage<N>>,
+// так что ресурс используется, только когда стек перерос N. Встроенные элементы
+// тоже конструируются с аллокатором стека, как в Stack (uses-allocator).
+// Верхние элементы всегда лежат в spill, поэтому pop сначала опустошает его.
+template<typename T, std::size_t N>
+class SmallStack {
+public:
+    using allocator_type = std::pmr::polymorphic_allocator<T>;
+
+private:
+    allocator_type alloc;
+    StaticStack<T, N> local;
+    Stack<T, ChunkedStorage<N>> spill;
+
+    template<bool Move, typename Source>
+    void append_local(Source& other) {
+        for (std::size_t i = 0; i < other.local.count; ++i) {
+            local.emplace_from([&]() -> T {
+                if constexpr (Move) return detail::make_using_allocator<T>(alloc, std::move(other.local.data()[i]));
+                else return detail::make_using_allocator<T>(alloc, other.local.data()[i]);
+            });
+        }
+    }
+
+public:
+    explicit SmallStack(const allocator_type& a = allocator_type())
+        : alloc(a), spill(a) {}
+
+    SmallStack(const SmallStack& other)
+        : SmallStack(other, std::allocator_traits<allocator_type>::select_on_container_copy_construction(
+                                other.get_allocator())) {}
+
+    SmallStack(const SmallStack& other, const allocator_type& a)
+        : alloc(a), spill(other.spill, a) {
+        append_local<false>(other);
+    }
+
+    SmallStack(SmallStack&& other)
+        : alloc(other.alloc), spill(std::move(other.spill)) {
+        append_local<true>(other);
+        other.local.clear();
+    }
+
+    SmallStack(SmallStack&& other, const allocator_type& a)
+        : alloc(a), spill(std::move(other.spill), a) {
+        append_local<true>(other);
+        other.local.clear();
+    }
+
+    SmallStack& operator=(const SmallStack& other) {
+        if (this != &other) {
+            SmallStack copy(other, alloc);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    SmallStack& operator=(SmallStack&& other) {
+        if (this != &other) {
+            clear();
+            spill = std::move(other.spill);
+            append_local<true>(other);
+            other.local.clear();
+        }
+        return *this;
+    }
+
+    allocator_type get_allocator() const { return alloc; }
+
+    template<typename... Args>
+    T& emplace(Args&&... args) {
+        if (local.full()) return spill.emplace(std::forward<Args>(args)...);
+        return local.emplace_from([&]() -> T {
+            return detail::make_using_allocator<T>(alloc, std::forward<Args>(args)...);
+        });
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    template<typename InputIt>
+    void push_range(InputIt first, InputIt last) {
+        std::size_t pushed = 0;
+        try {
+            for (; first != last; ++first, ++pushed) emplace(*first);
+        } catch (...) {
+            pop_n(pushed);
+            throw;
+        }
+    }
+
+    std::size_t pop_n(std::size_t n) {
+        std::size_t taken = spill.pop_n(n);
+        return taken + local.pop_n(n - taken);
+    }
+
+    void pop() {
+        if (!spill.empty()) spill.pop();
+        else local.pop();
+    }
+
+    T& top() { return spill.empty() ? local.top() : spill.top(); }
+    const T& top() const { return spill.empty() ? local.top() : spill.top(); }
+
+    bool empty() const { return local.empty(); }
+    // true, если часть элементов уже лежит в ресурсе.
+    bool spilled() const { return !spill.empty(); }
+    void clear() {
+        spill.clear();
+        local.clear();
+    }
+
+    std::size_t size() const { return local.size() + spill.size(); }
+    static constexpr std::size_t inline_capacity() { return N; }
+
+    class iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = T*;
+        using reference = T&;
+
+    private:
+        using spill_iterator = typename Stack<T, ChunkedStorage<N>>::iterator;
+        using local_iterator = typename StaticStack<T, N>::iterator;
+
+        spill_iterator spill_pos;
+        local_iterator local_pos;
+
+    public:
+        iterator() = default;
+        iterator(spill_iterator s, local_iterator l) : spill_pos(s), local_pos(l) {}
+
+        reference operator*() const { return spill_pos != spill_iterator() ? *spill_pos : *local_pos; }
+        pointer operator->() const { return &**this; }
+
+        iterator& operator++() {
+            if (spill_pos != spill_iterator()) ++spill_pos;
+            else ++local_pos;
+            return *this;
+        }
+
+        iterator operator++(int) {
+            iterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool operator==(const iterator& other) const {
+            return spill_pos == other.spill_pos && local_pos == other.local_pos;
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+    };
+
+    iterator begin() { return iterator(spill.begin(), local.begin()); }
+    iterator end() { return iterator(spill.end(), local.end()); }
+};
+
+// Пул одинаковых ячеек под узлы Stack<T>: свободные ячейки связаны в односвязный
+// список прямо внутри буфера, ещё не выданные ячейки раздаются сдвигом указателя.
+template<typename T>
+class NodePoolResource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t slot_alignment = Stack<T>::node_alignment < alignof(void*)
+        ? alignof(void*) : Stack<T>::node_alignment;
+    static constexpr std::size_t slot_size =
+        (std::max(Stack<T>::node_size, sizeof(void*)) + slot_alignment - 1) / slot_alignment * slot_alignment;
+
+private:
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    char* buffer;
+    std::size_t capacity;
+    std::size_t used = 0;
+    FreeSlot* free_head = nullptr;
+
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (bytes > slot_size || alignment > slot_alignment) throw std::bad_alloc();
+        if (free_head) {
+            FreeSlot* slot = free_head;
+            free_head = slot->next;
+            return slot;
+        }
+        if (used == capacity) throw std::bad_alloc();
+        return buffer + slot_size * used++;
+    }
+
+    void do_deallocate(void* p, std::size_t /*bytes*/, std::size_t /*alignment*/) override {
+        if (!p) return;
+        free_head = ::new (p) FreeSlot{free_head};
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+public:
+    explicit NodePoolResource(std::size_t size = 1024 * 1024)
+        : capacity(size / slot_size) {
+        buffer = static_cast<char*>(::operator new(capacity * slot_size, std::align_val_t(slot_alignment)));
+    }
+
+    ~NodePoolResource() override {
+        ::operator delete(buffer, std::align_val_t(slot_alignment));
+    }
+
+    NodePoolResource(const NodePoolResource&) = delete;
+    NodePoolResource& operator=(const NodePoolResource&) = delete;
+    NodePoolResource(NodePoolResource&& other) noexcept
+        : buffer(other.buffer), capacity(other.capacity), used(other.used), free_head(other.free_head) {
+        other.buffer = nullptr;
+        other.capacity = 0;
+        other.used = 0;
+        other.free_head = nullptr;
+    }
+
+    NodePoolResource& operator=(NodePoolResource&& other) noexcept {
+        if (this != &other) {
+            ::operator delete(buffer, std::align_val_t(slot_alignment));
+            buffer = other.buffer;
+            capacity = other.capacity;
+            used = other.used;
+            free_head = other.free_head;
+
+            other.buffer = nullptr;
+            other.capacity = 0;
+            other.used = 0;
+            other.free_head = nullptr;
+        }
+        return *this;
+    }
+};
+
+// Стек Трайбера для общего доступа из нескольких потоков. Узлы (значение и ссылка
+// на следующий, как у Stack) выделяются одним массивом заданной ёмкости при
+// создании и дальше только переходят между двумя списками: стеком значений и
+// списком свободных узлов, поэтому push/pop не обращаются к ресурсу памяти.
+// Вершины обоих списков хранятся словом «индекс узла | метка»; метка растёт при
+// каждой замене вершины, так что вернувшийся на вершину тот же узел (ABA) не
+// проходит compare_exchange.
+template<typename T>
+class ConcurrentStack {
+private:
+    using index_type = std::uint32_t;
+    static constexpr index_type npos = std::numeric_limits<index_type>::max();
+
+    struct Node {
+        alignas(T) unsigned char storage[sizeof(T)];
+        std::atomic<index_type> next;
+
+        T* value() { return std::launder(reinterpret_cast<T*>(storage)); }
+    };
+
+    Node* nodes;
+    std::size_t node_count;
+    std::pmr::memory_resource* upstream;
+    std::atomic<std::uint64_t> top_word;
+    std::atomic<std::uint64_t> free_word;
+
+    static std::uint64_t pack(index_type index, std::uint64_t tag) {
+        return (tag << 32) | index;
+    }
+
+    static index_type index_of(std::uint64_t word) { return static_cast<index_type>(word); }
+    static std::uint64_t tag_of(std::uint64_t word) { return word >> 32; }
+
+    bool try_push_index(std::atomic<std::uint64_t>& head, index_type index) {
+        std::uint64_t old = head.load(std::memory_order_relaxed);
+        nodes[index].next.store(index_of(old), std::memory_order_relaxed);
+        return head.compare_exchange_weak(old, pack(index, tag_of(old) + 1),
+                                          std::memory_order_release, std::memory_order_relaxed);
+    }
+
+    // Одна попытка снять вершину; в out записывается npos, если список пуст.
+    bool try_pop_index(std::atomic<std::uint64_t>& head, index_type& out) {
+        std::uint64_t old = head.load(std::memory_order_acquire);
+        out = index_of(old);
+        if (out == npos) return true;
+        index_type next = nodes[out].next.load(std::memory_order_relaxed);
+        return head.compare_exchange_weak(old, pack(next, tag_of(old) + 1),
+                                          std::memory_order_acquire, std::memory_order_relaxed);
+    }
+
+    void push_index(std::atomic<std::uint64_t>& head, index_type index) {
+        while (!try_push_index(head, index)) {}
+    }
+
+    index_type pop_index(std::atomic<std::uint64_t>& head) {
+        index_type index;
+        while (!try_pop_index(head, index)) {}
+        return index;
+    }
+
+    // Массив исключения: push и pop, не сумевшие заменить вершину, встречаются в
+    // случайной ячейке и передают узел друг другу, минуя top_word. Ячейка хранит
+    // «метка | состояние | индекс узла»; метка защищает ячейку от ABA.
+    static constexpr std::uint64_t slot_empty = 0;
+    static constexpr std::uint64_t slot_waiting = 1;
+    static constexpr int elimination_spin = 128;
+
+    std::atomic<std::uint64_t>* slots = nullptr;
+    std::size_t slot_count = 0;
+    std::atomic<std::uint64_t> elimination_attempts{0};
+    std::atomic<std::uint64_t> elimination_successes{0};
+
+    static std::uint64_t pack_slot(std::uint64_t state, index_type index, std::uint64_t tag) {
+        return (tag << 34) | (state << 32) | index;
+    }
+
+    static std::uint64_t slot_state(std::uint64_t word) { return (word >> 32) & 3; }
+    static std::uint64_t slot_tag(std::uint64_t word) { return word >> 34; }
+
+    std::atomic<std::uint64_t>& random_slot() {
+        thread_local std::uint32_t seed = static_cast<std::uint32_t>(
+            reinterpret_cast<std::uintptr_t>(&seed) >> 4) | 1;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return slots[seed % slot_count];
+    }
+
+    bool eliminate_push(index_type index) {
+        elimination_attempts.fetch_add(1, std::memory_order_relaxed);
+        std::atomic<std::uint64_t>& slot = random_slot();
+        std::uint64_t word = slot.load(std::memory_order_relaxed);
+        if (slot_state(word) != slot_empty) return false;
+        std::uint64_t offer = pack_slot(slot_waiting, index, slot_tag(word) + 1);
+        if (!slot.compare_exchange_strong(word, offer, std::memory_order_release, std::memory_order_relaxed)) {
+            return false;
+        }
+        for (int i = 0; i < elimination_spin; ++i) {
+            if (slot.load(std::memory_order_relaxed) != offer) break;
+        }
+        std::uint64_t expected = offer;
+        if (slot.compare_exchange_strong(expected, pack_slot(slot_empty, npos, slot_tag(offer) + 1),
+                                         std::memory_order_relaxed, std::memory_order_relaxed)) {
+            return false;
+        }
+        return true;
+    }
+
+    index_type eliminate_pop() {
+        elimination_attempts.fetch_add(1, std::memory_order_relaxed);
+        std::atomic<std::uint64_t>& slot = random_slot();
+        std::uint64_t word = slot.load(std::memory_order_relaxed);
+        if (slot_state(word) != slot_waiting) return npos;
+        if (!slot.compare_exchange_strong(word, pack_slot(slot_empty, npos, slot_tag(word) + 1),
+                                          std::memory_order_acquire, std::memory_order_relaxed)) {
+            return npos;
+        }
+        elimination_successes.fetch_add(1, std::memory_order_relaxed);
+        return index_of(word);
+    }
+
+    void push_top(index_type index) {
+        while (!try_push_index(top_word, index)) {
+            if (slot_count && eliminate_push(index)) return;
+        }
+    }
+
+    index_type pop_top() {
+        index_type index;
+        while (!try_pop_index(top_word, index)) {
+            if (slot_count && (index = eliminate_pop()) != npos) return index;
+        }
+        return index;
+    }
+
+public:
+    // attempts считает обращения к массиву с обеих сторон, successes —
+    // состоявшиеся обмены (каждый засчитывается один раз, со стороны pop).
+    struct EliminationStats {
+        std::uint64_t attempts;
+        std::uint64_t successes;
+    };
+
+    // elimination_width > 0 включает массив исключения из стольких ячеек.
+    explicit ConcurrentStack(std::size_t capacity,
+                             std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+                             std::size_t elimination_width = 0)
+        : node_count(capacity), upstream(resource), top_word(pack(npos, 0)), free_word(pack(npos, 0)) {
+        if (capacity >= npos) throw std::length_error("ConcurrentStack: capacity is too large");
+        if (elimination_width) {
+            slots = static_cast<std::atomic<std::uint64_t>*>(
+                upstream->allocate(sizeof(std::atomic<std::uint64_t>) * elimination_width,
+                                   alignof(std::atomic<std::uint64_t>)));
+            for (std::size_t i = 0; i < elimination_width; ++i) {
+                ::new (static_cast<void*>(slots + i)) std::atomic<std::uint64_t>(pack_slot(slot_empty, npos, 0));
+            }
+            slot_count = elimination_width;
+        }
+        nodes = static_cast<Node*>(upstream->allocate(sizeof(Node) * capacity, alignof(Node)));
+        for (std::size_t i = capacity; i-- > 0;) {
+            ::new (static_cast<void*>(nodes + i)) Node;
+            nodes[i].next.store(i + 1 < capacity ? static_cast<index_type>(i + 1) : npos,
+                                std::memory_order_relaxed);
+        }
+        free_word.store(pack(capacity ? 0 : npos, 0), std::memory_order_relaxed);
+    }
+
+    ~ConcurrentStack() {
+        for (index_type i = index_of(top_word.load()); i != npos; i = nodes[i].next.load()) {
+            nodes[i].value()->~T();
+        }
+        upstream->deallocate(nodes, sizeof(Node) * node_count, alignof(Node));
+        if (slots) {
+            upstream->deallocate(slots, sizeof(std::atomic<std::uint64_t>) * slot_count,
+                                 alignof(std::atomic<std::uint64_t>));
+        }
+    }
+
+    ConcurrentStack(const ConcurrentStack&) = delete;
+    ConcurrentStack& operator=(const ConcurrentStack&) = delete;
+
+    template<typename... Args>
+    void emplace(Args&&... args) {
+        index_type index = pop_index(free_word);
+        if (index == npos) throw std::bad_alloc();
+        try {
+            ::new (static_cast<void*>(nodes[index].storage)) T(std::forward<Args>(args)...);
+        } catch (...) {
+            push_index(free_word, index);
+            throw;
+        }
+        push_top(index);
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    // Если перемещение T бросило исключение, узел возвращается на вершину вместе
+    // со значением: ни элемент, ни ёмкость не теряются.
+    std::optional<T> try_pop() {
+        index_type index = pop_top();
+        if (index == npos) return std::nullopt;
+        T* value = nodes[index].value();
+        std::optional<T> result;
+        try {
+            result.emplace(std::move(*value));
+        } catch (...) {
+            push_top(index);
+            throw;
+        }
+        value->~T();
+        push_index(free_word, index);
+        return result;
+    }
+
+    bool empty() const { return index_of(top_word.load(std::memory_order_acquire)) == npos; }
+    std::size_t capacity() const { return node_count; }
+
+    EliminationStats elimination_stats() const {
+        return {elimination_attempts.load(std::memory_order_relaxed),
+                elimination_successes.load(std::memory_order_relaxed)};
+    }
+};
+
+// Набор стеков по одному на поток, каждый в своём FixedBufferResource. Поток
+// работает со своим стеком в порядке LIFO под почти всегда свободным мьютексом;
+// опустошив его, поток забирает у соседа половину элементов. Односвязный Stack не
+// позволяет за O(1) снимать элементы снизу, как в деке Чейза-Лева, поэтому
+// элементы забираются с вершины, зато сразу пачкой, что делает кражи редкими.
+template<typename T>
+class ShardedStack {
+private:
+    struct Shard {
+        std::mutex mutex;
+        FixedBufferResource resource;
+        Stack<T> stack;
+        std::size_t index;
+
+        Shard(std::size_t buffer_size, std::size_t i)
+            : resource(buffer_size), stack(std::pmr::polymorphic_allocator<T>(&resource)), index(i) {}
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Shard& own_shard() { return *shards[detail::thread_slot() % shards.size()]; }
+
+    static std::optional<T> pop_from(Shard& shard) {
+        std::optional<T> result(std::move(shard.stack.top()));
+        shard.stack.pop();
+        return result;
+    }
+
+    // Элемент снимается с соседа только после того, как попал на новое место, и
+    // переносится через move_if_noexcept, поэтому исключение ничего не теряет. Если
+    // перенос пачки прервался (например, кончился буфер своего шарда), остаток
+    // просто остаётся у соседа. Мьютексы обоих шардов уже взяты.
+    static std::optional<T> take_half(Shard& self, Shard& victim) {
+        std::size_t batch = (victim.stack.size() + 1) / 2;
+        std::optional<T> result(std::move_if_noexcept(victim.stack.top()));
+        victim.stack.pop();
+        try {
+            while (--batch > 0) {
+                self.stack.push(std::move_if_noexcept(victim.stack.top()));
+                victim.stack.pop();
+            }
+        } catch (...) {
+        }
+        return result;
+    }
+
+    // Первый проход пропускает соседей с занятым мьютексом. Если так ничего не
+    // нашлось, второй проход ждёт каждого соседа; свой мьютекс при этом берётся
+    // заново вместе с чужим через std::lock, иначе два потока, ворующие друг у
+    // друга, заблокировали бы друг друга.
+    std::optional<T> steal_into(Shard& self, std::unique_lock<std::mutex>& own) {
+        for (std::size_t k = 1; k < shards.size(); ++k) {
+            Shard& victim = *shards[(self.index + k) % shards.size()];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::try_to_lock);
+            if (lock && !victim.stack.empty()) return take_half(self, victim);
+        }
+        own.unlock();
+        for (std::size_t k = 1; k < shards.size(); ++k) {
+            Shard& victim = *shards[(self.index + k) % shards.size()];
+            std::unique_lock<std::mutex> lock(victim.mutex, std::defer_lock);
+            std::lock(own, lock);
+            if (!self.stack.empty()) return pop_from(self);
+            if (!victim.stack.empty()) return take_half(self, victim);
+            own.unlock();
+        }
+        return std::nullopt;
+    }
+
+public:
+    explicit ShardedStack(std::size_t shard_buffer_size = 1024 * 1024,
+                          std::size_t shards_total = std::max(1u, std::thread::hardware_concurrency())) {
+        for (std::size_t i = 0; i < shards_total; ++i) {
+            shards.push_back(std::make_unique<Shard>(shard_buffer_size, i));
+        }
+    }
+
+    ShardedStack(const ShardedStack&) = delete;
+    ShardedStack& operator=(const ShardedStack&) = delete;
+
+    // Как и ConcurrentStack::push, ничего не возвращает: после снятия мьютекса
+    // элемент могут забрать или украсть другие потоки.
+    template<typename... Args>
+    void emplace(Args&&... args) {
+        Shard& shard = own_shard();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.stack.emplace(std::forward<Args>(args)...);
+    }
+
+    void push(const T& value) { emplace(value); }
+    void push(T&& value) { emplace(std::move(value)); }
+
+    // nullopt означает, что каждый шард был пуст, когда его проверяли; элементы,
+    // добавленные в уже проверенные шарды во время поиска, не учитываются.
+    std::optional<T> try_pop() {
+        Shard& shard = own_shard();
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        if (!shard.stack.empty()) return pop_from(shard);
+        return steal_into(shard, lock);
+    }
+
+    // Сумма размеров шардов; при одновременных операциях значение приблизительное.
+    std::size_t size() {
+        std::size_t total = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            total += shard->stack.size();
+        }
+        return total;
+    }
+
+    // Обходит элементы шард за шардом через Stack::iterator, удерживая мьютекс шарда.
+    template<typename F>
+    void for_each(F f) {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            for (T& value : shard->stack) f(value);
+        }
+    }
+
+    std::size_t shards_total() const { return shards.size(); }
+};
+
+// Имя хранится в std::pmr::string, а allocator_type и конструкторы с аллокатором
+// включают протокол uses-allocator: в Stack<Person> над FixedBufferResource и узел,
+// и длинное имя берутся из одного ресурса и уходят вместе с ним.
+struct Person {
+    using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+    std::pmr::string name;
+    int age;
+
+    Person(std::string_view n, int a, const allocator_type& alloc = allocator_type())
+        : name(n, alloc), age(a) {
+        std::cout << "Person(" << name << ") constructed\n";
+    }
+
+    Person(const Person& other) = default;
+
+    Person(const Person& other, const allocator_type& alloc)
+        : name(other.name, alloc), age(other.age) {}
+
+    allocator_type get_allocator() const { return name.get_allocator(); }
+
+    ~Person() {
+        std::cout << "Person(" << name << ") destroyed\n";
+    }
+};
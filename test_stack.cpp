@@ -1,7 +1,16 @@
 #include <iostream>
 #include <vector>
 #include <cassert>
+#include <thread>
+#include <chrono>
+#include <sstream>
+// Тесты проверяют раскладку буфера незащищённого FixedBufferResource, поэтому
+// переключатель сборки здесь всегда выключен; защищённый режим проверяется
+// через CheckedFixedBufferResource.
+#undef STACK_CHECKED_RESOURCE
+#define STACK_CHECKED_RESOURCE 0
 #include "stack.h"
+#include "fragmentation_workload.h"
 
 void test_fixed_buffer_resource_basic() {
     std::cout << "Testing FixedBufferResource Basic\n";
@@ -22,6 +31,24 @@ void test_fixed_buffer_resource_basic() {
     resource.deallocate(ptr2, 128, 16);
     std::cout << "Deallocated second block\n";
     
+    // Размер, близкий к SIZE_MAX, не должен переполняться при округлении до гранулы.
+    auto rejects_huge = [](std::pmr::memory_resource& r) {
+        try {
+            (void)r.allocate(std::numeric_limits<std::size_t>::max() - 3, 8);
+        } catch (const std::bad_alloc&) {
+            return true;
+        }
+        return false;
+    };
+    assert(rejects_huge(resource));
+    FixedBufferResource with_upstream(1024, std::pmr::new_delete_resource());
+    assert(rejects_huge(with_upstream));
+    CheckedFixedBufferResource checked(1024);
+    assert(rejects_huge(checked));
+    ConcurrentFixedBufferResource concurrent(4096);
+    assert(rejects_huge(concurrent));
+    std::cout << "Request of SIZE_MAX - 3 bytes throws bad_alloc\n";
+    
     std::cout << "Basic allocation test passed\n\n";
 }
 
@@ -47,6 +74,216 @@ void test_fixed_buffer_resource_reuse() {
     std::cout << "\n";
 }
 
+void test_fixed_buffer_resource_size_classes() {
+    std::cout << "Testing Size-Class Free Lists\n";
+    
+    FixedBufferResource resource(1024);
+    std::vector<void*> blocks;
+    
+    try {
+        for (;;) blocks.push_back(resource.allocate(16, 8));
+    } catch (const std::bad_alloc&) {
+    }
+    std::cout << "Filled buffer with " << blocks.size() << " blocks of 16 bytes\n";
+    
+    for (void* p : blocks) {
+        resource.deallocate(p, 16, 8);
+    }
+    
+    for (std::size_t i = 0; i < blocks.size(); ++i) {
+        void* p = resource.allocate(16, 8);
+        assert(p != nullptr);
+    }
+    std::cout << "All freed blocks were reused\n";
+    
+    std::cout << "Size-class free lists test passed\n\n";
+}
+
+void test_fixed_buffer_resource_coalescing() {
+    std::cout << "Testing Free Block Coalescing\n";
+    
+    FixedBufferResource resource(1024);
+    
+    void* a = resource.allocate(64, 8);
+    void* b = resource.allocate(64, 8);
+    void* c = resource.allocate(64, 8);
+    void* guard = resource.allocate(64, 8);
+    
+    resource.deallocate(a, 64, 8);
+    resource.deallocate(c, 64, 8);
+    resource.deallocate(b, 64, 8);
+    std::cout << "Freed three neighbouring blocks out of order\n";
+    
+    void* merged = resource.allocate(192, 8);
+    assert(merged == a);
+    std::cout << "192-byte allocation reused the merged block at: " << merged << "\n";
+    
+    resource.deallocate(merged, 192, 8);
+    resource.deallocate(guard, 64, 8);
+    
+    void* whole = resource.allocate(256, 8);
+    assert(whole == a);
+    std::cout << "Freed tail was folded back, allocation starts at the buffer head again\n";
+    resource.deallocate(whole, 256, 8);
+    
+    std::cout << "Coalescing test passed\n\n";
+}
+
+void test_fixed_buffer_resource_intrusive() {
+    std::cout << "Testing Free List Stays Inside The Buffer\n";
+    
+    FixedBufferResource resource(16384);
+    std::vector<void*> blocks;
+    
+    for (int i = 0; i < 100; ++i) {
+        blocks.push_back(resource.allocate(8 + (i % 5) * 24, 8));
+    }
+    for (std::size_t i = 0; i < blocks.size(); i += 2) {
+        resource.deallocate(blocks[i], 8 + (i % 5) * 24, 8);
+    }
+    
+    void* aligned = resource.allocate(40, 64);
+    assert(reinterpret_cast<std::uintptr_t>(aligned) % 64 == 0);
+    std::cout << "Over-aligned allocation served at: " << aligned << "\n";
+    resource.deallocate(aligned, 40, 64);
+    
+    for (std::size_t i = 1; i < blocks.size(); i += 2) {
+        resource.deallocate(blocks[i], 8 + (i % 5) * 24, 8);
+    }
+    
+    void* first = resource.allocate(16, 8);
+    assert(first == blocks[0]);
+    std::cout << "Everything merged back, next allocation starts at the buffer head\n";
+    
+    std::cout << "Intrusive free list test passed\n\n";
+}
+
+void test_fixed_buffer_resource_stats() {
+    std::cout << "Testing FixedBufferResource Statistics\n";
+    
+    static_assert(sizeof(FixedBufferResource) < sizeof(InstrumentedFixedBufferResource),
+                  "statistics must not take space when disabled");
+    
+    InstrumentedFixedBufferResource resource(4096);
+    void* a = resource.allocate(10, 8);
+    void* b = resource.allocate(64, 8);
+    void* c = resource.allocate(16, 8);
+    
+    const AllocationStats& stats = resource.stats();
+    assert(stats.allocations == 3);
+    assert(stats.bytes_in_use == 16 + 64 + 16);
+    assert(stats.rounding_waste == 6);
+    assert(stats.size_histogram[4] == 1 && stats.size_histogram[7] == 1 && stats.size_histogram[5] == 1);
+    std::size_t peak = stats.high_water_mark;
+    
+    resource.deallocate(b, 64, 8);
+    assert(resource.free_list_length() == 1);
+    assert(resource.fragmentation() > 0.0);
+    std::cout << "Fragmentation with a hole in the middle: " << resource.fragmentation() << "\n";
+    
+    resource.deallocate(c, 16, 8);
+    resource.deallocate(a, 10, 8);
+    assert(stats.deallocations == 3);
+    assert(stats.bytes_in_use == 0);
+    assert(resource.free_list_length() == 0);
+    assert(resource.fragmentation() == 0.0);
+    assert(stats.high_water_mark == peak);
+    
+    std::ostringstream json;
+    resource.dump_stats_json(json);
+    assert(json.str().find("\"allocations\":3") != std::string::npos);
+    std::cout << "Stats: " << json.str() << "\n";
+    
+    // Stack возвращает соседние узлы одним вызовом: вызовы расходятся, байты — нет.
+    InstrumentedFixedBufferResource bulk_resource(4096);
+    {
+        Stack<int> stack{std::pmr::polymorphic_allocator<int>(&bulk_resource)};
+        for (int i = 0; i < 10; ++i) stack.push(i);
+        stack.pop_n(4);
+        const AllocationStats& bulk = bulk_resource.stats();
+        assert(bulk.allocations == 10 && bulk.deallocations == 1);
+        assert(bulk.allocated_bytes - bulk.deallocated_bytes == bulk.bytes_in_use);
+        stack.clear();
+        assert(bulk.deallocations == 2);
+        assert(bulk.bytes_in_use == 0 && bulk.allocated_bytes == bulk.deallocated_bytes);
+    }
+    std::cout << "Byte counters agree after pop_n and clear\n";
+    
+    std::cout << "Statistics test passed\n\n";
+}
+
+void test_fixed_buffer_resource_upstream() {
+    std::cout << "Testing Upstream Fallback\n";
+    
+    FixedBufferResource bounded(1024);
+    bool thrown = false;
+    try {
+        (void)bounded.allocate(2048, 8);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Without upstream an oversized request still throws\n";
+    
+    FixedBufferResource resource(1024, std::pmr::new_delete_resource());
+    void* first = resource.allocate(16, 8);
+    assert(resource.overflow_buffers() == 0);
+    
+    {
+        std::pmr::polymorphic_allocator<int> alloc(&resource);
+        Stack<int> stack(alloc);
+        for (int i = 0; i < 1000; ++i) stack.push(i);
+        assert(stack.size() == 1000);
+        assert(stack.top() == 999);
+        std::cout << "1000 nodes spilled into " << resource.overflow_buffers() << " upstream buffers\n";
+        assert(resource.overflow_buffers() > 1);
+        
+        std::vector<int> batch(500, 7);
+        stack.push_range(batch.begin(), batch.end());
+        assert(stack.size() == 1500);
+        stack.clear();
+    }
+    resource.deallocate(first, 16, 8);
+    
+    void* again = resource.allocate(16, 8);
+    assert(again == first);
+    resource.deallocate(again, 16, 8);
+    std::cout << "Primary buffer is served first again after the spike\n";
+    
+    resource.release();
+    assert(resource.overflow_buffers() == 0);
+    
+    std::cout << "Upstream fallback test passed\n\n";
+}
+
+void test_fixed_buffer_resource_external_buffer() {
+    std::cout << "Testing External And Mapped Buffers\n";
+    
+    alignas(std::max_align_t) char storage[4096];
+    {
+        FixedBufferResource resource(storage, sizeof(storage));
+        std::pmr::polymorphic_allocator<int> alloc(&resource);
+        Stack<int> stack(alloc);
+        for (int i = 0; i < 100; ++i) stack.push(i);
+        char* top = reinterpret_cast<char*>(&stack.top());
+        assert(top >= storage && top < storage + sizeof(storage));
+        std::cout << "Stack nodes live in a caller-provided array\n";
+    }
+    
+#if FIXED_BUFFER_HAS_MMAP
+    FixedBufferResource mapped = FixedBufferResource::mapped(4 * 1024 * 1024);
+    std::cout << "Mapped buffer, huge pages: " << (mapped.uses_huge_pages() ? "yes" : "no") << "\n";
+    std::pmr::polymorphic_allocator<int> alloc(&mapped);
+    Stack<int> stack(alloc);
+    for (int i = 0; i < 100000; ++i) stack.push(i);
+    assert(stack.size() == 100000);
+    assert(stack.top() == 99999);
+    stack.clear();
+#endif
+    
+    std::cout << "External buffer test passed\n\n";
+}
+
 void test_stack_basic() {
     std::cout << "Testing Stack Basic Operations\n";
     
@@ -81,6 +318,46 @@ void test_stack_basic() {
     std::cout << "Stack basic operations test passed\n\n";
 }
 
+class RecordingResource : public std::pmr::memory_resource {
+public:
+    std::size_t last_bytes = 0;
+    std::size_t last_alignment = 0;
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        last_bytes = bytes;
+        last_alignment = alignment;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+        assert(bytes == last_bytes && alignment == last_alignment);
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+void test_stack_node_allocation_size() {
+    std::cout << "Testing Stack Node Allocation Size\n";
+    
+    RecordingResource resource;
+    std::pmr::polymorphic_allocator<int> alloc(&resource);
+    Stack<int> stack(alloc);
+    
+    stack.push(1);
+    assert(resource.last_bytes == Stack<int>::node_size);
+    assert(resource.last_alignment == Stack<int>::node_alignment);
+    std::cout << "Stack<int> requested " << resource.last_bytes << " bytes per node\n";
+    stack.pop();
+    
+    assert(stack.get_allocator().resource() == &resource);
+    
+    std::cout << "Node allocation size test passed\n\n";
+}
+
 void test_stack_iterator() {
     std::cout << "Testing Stack Iterator\n";
     
@@ -107,6 +384,84 @@ void test_stack_iterator() {
     std::cout << "Stack iterator test passed\n\n";
 }
 
+void test_node_pool_resource() {
+    std::cout << "Testing NodePoolResource\n";
+    
+    NodePoolResource<int> pool(64 * NodePoolResource<int>::slot_size);
+    
+    void* ptr1 = pool.allocate(Stack<int>::node_size, Stack<int>::node_alignment);
+    pool.deallocate(ptr1, Stack<int>::node_size, Stack<int>::node_alignment);
+    void* ptr2 = pool.allocate(Stack<int>::node_size, Stack<int>::node_alignment);
+    assert(ptr1 == ptr2);
+    std::cout << "Freed slot reused at: " << ptr2 << "\n";
+    pool.deallocate(ptr2, Stack<int>::node_size, Stack<int>::node_alignment);
+    
+    std::pmr::polymorphic_allocator<int> alloc(&pool);
+    Stack<int> stack(alloc);
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 64; ++i) stack.push(i);
+        assert(stack.size() == 64);
+        assert(stack.top() == 63);
+        stack.clear();
+    }
+    std::cout << "Filled and drained the pool three times\n";
+    
+    bool thrown = false;
+    try {
+        (void)pool.allocate(NodePoolResource<int>::slot_size + 1, 8);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    assert(thrown);
+    std::cout << "Oversized request rejected\n";
+    
+    std::cout << "NodePoolResource test passed\n\n";
+}
+
+void test_chunked_stack() {
+    std::cout << "Testing Chunked Stack Storage\n";
+    
+    FixedBufferResource resource(4096);
+    std::pmr::polymorphic_allocator<int> alloc(&resource);
+    Stack<int, ChunkedStorage<4>> stack(alloc);
+    
+    for (int i = 0; i < 10; ++i) stack.push(i);
+    assert(stack.size() == 10);
+    assert(stack.top() == 9);
+    std::cout << "Pushed 10 elements across chunks of 4\n";
+    
+    int expected = 9;
+    std::cout << "Stack elements (range-based for): ";
+    for (int value : stack) {
+        assert(value == expected--);
+        std::cout << value << " ";
+    }
+    std::cout << "\n";
+    assert(expected == -1);
+    
+    for (int i = 0; i < 5; ++i) stack.pop();
+    assert(stack.size() == 5);
+    assert(stack.top() == 4);
+    stack.push(42);
+    assert(stack.top() == 42);
+    std::cout << "Popped across a chunk boundary and pushed again, top is: " << stack.top() << "\n";
+    
+    stack.clear();
+    assert(stack.empty());
+    
+    std::pmr::polymorphic_allocator<Person> person_alloc(&resource);
+    Stack<Person, ChunkedStorage<2>> people(person_alloc);
+    people.push(Person("Carol", 41));
+    people.push(Person("Dave", 35));
+    people.push(Person("Eve", 29));
+    assert(people.size() == 3);
+    assert(people.top().name == "Eve");
+    people.pop();
+    assert(people.top().name == "Dave");
+    
+    std::cout << "Chunked storage test passed\n\n";
+}
+
 void test_stack_complex_type() {
     std::cout << "Testing Stack with Complex Type\n";
     
@@ -130,6 +485,168 @@ void test_stack_complex_type() {
     std::cout << "Complex type test passed\n\n";
 }
 
+struct Tracked {
+    static int constructions;
+    static int copies_and_moves;
+    
+    int a;
+    int b;
+    
+    Tracked(int x, int y) : a(x), b(y) { ++constructions; }
+    Tracked(const Tracked& other) : a(other.a), b(other.b) { ++copies_and_moves; }
+    Tracked(Tracked&& other) noexcept : a(other.a), b(other.b) { ++copies_and_moves; }
+};
+
+int Tracked::constructions = 0;
+int Tracked::copies_and_moves = 0;
+
+void test_stack_arena_reset() {
+    std::cout << "Testing Arena Reset With release()\n";
+    
+    FixedBufferResource resource(2048);
+    std::pmr::polymorphic_allocator<int> alloc(&resource);
+    void* head = resource.allocate(16, 8);
+    resource.release();
+    
+    Stack<int> stack(alloc);
+    Stack<int, ChunkedStorage<8>> chunked(alloc);
+    for (int request = 0; request < 100; ++request) {
+        for (int i = 0; i < 40; ++i) {
+            stack.push(i);
+            chunked.push(i);
+        }
+        assert(stack.size() == 40 && chunked.size() == 40);
+        stack.discard();
+        chunked.discard();
+        resource.release();
+    }
+    assert(stack.empty() && chunked.empty());
+    std::cout << "Recycled the arena for 100 requests without per-node work\n";
+    
+    void* again = resource.allocate(16, 8);
+    assert(again == head);
+    resource.deallocate(again, 16, 8);
+    
+    for (int i = 0; i < 40; ++i) chunked.push(i);
+    chunked.clear();
+    assert(chunked.empty());
+    
+    std::cout << "Arena reset test passed\n\n";
+}
+
+void test_stack_emplace() {
+    std::cout << "Testing Stack Emplace\n";
+    
+    FixedBufferResource resource(4096);
+    
+    Stack<Tracked> stack{std::pmr::polymorphic_allocator<Tracked>(&resource)};
+    Tracked& pushed = stack.emplace(1, 2);
+    assert(&pushed == &stack.top());
+    assert(stack.top().a == 1 && stack.top().b == 2);
+    
+    Stack<Tracked, ChunkedStorage<4>> chunked{std::pmr::polymorphic_allocator<Tracked>(&resource)};
+    chunked.emplace(3, 4);
+    assert(chunked.top().a == 3);
+    
+    assert(Tracked::constructions == 2);
+    assert(Tracked::copies_and_moves == 0);
+    std::cout << "Elements constructed in place without temporaries\n";
+    
+    const std::string long_name(64, 'x');
+    Stack<std::pmr::string> names{std::pmr::polymorphic_allocator<std::pmr::string>(&resource)};
+    names.emplace(long_name.c_str());
+    assert(names.top() == long_name.c_str());
+    assert(names.top().get_allocator().resource() == &resource);
+    
+    Stack<std::pmr::string, ChunkedStorage<4>> chunked_names{std::pmr::polymorphic_allocator<std::pmr::string>(&resource)};
+    chunked_names.emplace(long_name.c_str());
+    assert(chunked_names.top().get_allocator().resource() == &resource);
+    std::cout << "pmr::string elements use the stack's memory resource\n";
+    
+    std::cout << "Emplace test passed\n\n";
+}
+
+void test_stack_bulk_operations() {
+    std::cout << "Testing Stack push_range / pop_n\n";
+    
+    FixedBufferResource resource(4096);
+    std::pmr::polymorphic_allocator<int> alloc(&resource);
+    std::vector<int> batch = {1, 2, 3, 4, 5, 6, 7, 8};
+    
+    void* head = resource.allocate(16, 8);
+    resource.deallocate(head, 16, 8);
+    
+    {
+        Stack<int> stack(alloc);
+        stack.push(0);
+        stack.push_range(batch.begin(), batch.end());
+        assert(stack.size() == 9);
+        assert(stack.top() == 8);
+        
+        int expected = 8;
+        for (int value : stack) assert(value == expected--);
+        std::cout << "Pushed a batch of " << batch.size() << " elements in one allocation\n";
+        
+        stack.pop();
+        assert(stack.pop_n(3) == 3);
+        assert(stack.top() == 4);
+        assert(stack.pop_n(100) == 5);
+        assert(stack.empty());
+        std::cout << "Popped the batch back with pop_n\n";
+    }
+    void* again = resource.allocate(16, 8);
+    assert(again == head);
+    resource.deallocate(again, 16, 8);
+    std::cout << "All batch storage returned to the resource\n";
+    
+    RecordingResource recording;
+    Stack<int> fallback{std::pmr::polymorphic_allocator<int>(&recording)};
+    fallback.push_range(batch.begin(), batch.end());
+    assert(fallback.size() == batch.size());
+    assert(recording.last_bytes == Stack<int>::node_size);
+    assert(fallback.pop_n(4) == 4);
+    assert(fallback.top() == 4);
+    
+    Stack<int, ChunkedStorage<3>> chunked(alloc);
+    chunked.push_range(batch.begin(), batch.end());
+    assert(chunked.size() == batch.size());
+    assert(chunked.top() == 8);
+    assert(chunked.pop_n(5) == 5);
+    assert(chunked.top() == 3);
+    
+    // Буфер, в котором свободны только разрозненные узлы: блока на 10 узлов нет.
+    FixedBufferResource fragmented(4096);
+    std::vector<void*> blocks;
+    try {
+        for (;;) blocks.push_back(fragmented.allocate(Stack<int>::node_size, alignof(std::max_align_t)));
+    } catch (const std::bad_alloc&) {
+    }
+    for (std::size_t i = 0; i < blocks.size(); i += 2) {
+        fragmented.deallocate(blocks[i], Stack<int>::node_size, alignof(std::max_align_t));
+    }
+    {
+        Stack<int> scattered(&fragmented);
+        scattered.push_range(batch.begin(), batch.end());
+        assert(scattered.size() == batch.size());
+        assert(scattered.top() == 8);
+    }
+    std::cout << "Fragmented buffer fell back to one node at a time\n";
+    
+    // Пачкой выделяет любая комбинация политик, допускающая возврат по частям.
+    BasicFixedBufferResource<AllocationStats, NoAllocationGuard, LatencyTracing> traced_stats(4096);
+    {
+        Stack<int> any_policy(&traced_stats);
+        any_policy.push_range(batch.begin(), batch.end());
+        assert(traced_stats.stats().allocations == 1);
+    }
+    CheckedFixedBufferResource checked(4096);
+    assert(!detail::accepts_partial_deallocation(&checked));
+    assert(detail::accepts_partial_deallocation(&traced_stats));
+    std::cout << "Bulk paths follow the resource's partial_deallocation for any policy mix\n";
+    
+    std::cout << "Bulk operations test passed\n\n";
+}
+
 void test_stack_clear() {
     std::cout << "Testing Stack Clear\n";
     
@@ -152,16 +669,890 @@ void test_stack_clear() {
     std::cout << "Stack clear test passed\n\n";
 }
 
+void test_stack_serialization() {
+    std::cout << "Testing Stack Serialization\n";
+    
+    Stack<int> source;
+    for (int i = 0; i < 1000; ++i) source.push(i);
+    std::stringstream image;
+    source.serialize(image);
+    assert(image.str().size() == sizeof(detail::StackImageHeader) + 1000 * sizeof(int));
+    
+    InstrumentedFixedBufferResource resource(64 * 1024);
+    Stack<int> restored{std::pmr::polymorphic_allocator<int>(&resource)};
+    restored.push(-1);
+    restored.deserialize(image);
+    assert(restored.size() == 1000);
+    assert(resource.stats().allocations == 2);
+    int expected = 999;
+    for (int value : restored) assert(value == expected--);
+    std::cout << "Restored 1000 elements with a single node allocation\n";
+    
+    // Снимок из памяти с невыровненным началом и перенос между видами хранения.
+    std::string bytes = " " + image.str();
+    Stack<int, ChunkedStorage<64>> chunked;
+    chunked.deserialize(bytes.data() + 1, bytes.size() - 1);
+    assert(chunked.size() == 1000 && chunked.top() == 999);
+    std::stringstream chunked_image;
+    chunked.serialize(chunked_image);
+    assert(chunked_image.str() == image.str());
+    std::cout << "Chunked storage reads and writes the same image\n";
+    
+    bool rejected = false;
+    try {
+        Stack<double> wrong_type;
+        wrong_type.deserialize(bytes.data() + 1, bytes.size() - 1);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected);
+    rejected = false;
+    try {
+        restored.deserialize(bytes.data() + 1, bytes.size() - 2);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected && restored.size() == 1000);
+    
+    // Заголовок обещает 2^40 элементов, а данных в потоке на 1000.
+    std::string corrupt = image.str();
+    std::uint64_t huge_count = std::uint64_t(1) << 40;
+    std::memcpy(&corrupt[offsetof(detail::StackImageHeader, count)], &huge_count, sizeof(huge_count));
+    rejected = false;
+    try {
+        std::istringstream corrupt_in(corrupt);
+        restored.deserialize(corrupt_in);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected && restored.size() == 1000);
+    std::cout << "Foreign and truncated images are rejected\n";
+    
+    std::cout << "Stack serialization test passed\n\n";
+}
+
+template<typename StackType>
+std::vector<int> contents(StackType& stack) {
+    return std::vector<int>(stack.begin(), stack.end());
+}
+
+void test_stack_move_and_splice() {
+    std::cout << "Testing Stack Move, Swap And Splice\n";
+    
+    InstrumentedFixedBufferResource arena(64 * 1024);
+    InstrumentedFixedBufferResource other_arena(64 * 1024);
+    std::pmr::polymorphic_allocator<int> alloc(&arena);
+    std::pmr::polymorphic_allocator<int> other_alloc(&other_arena);
+    
+    Stack<int> a(alloc);
+    for (int i = 1; i <= 3; ++i) a.push(i);
+    int* top = &a.top();
+    std::size_t allocations = arena.stats().allocations;
+    
+    Stack<int> moved(std::move(a));
+    assert(a.empty() && a.size() == 0);
+    assert(&moved.top() == top && moved.size() == 3);
+    assert(arena.stats().allocations == allocations);
+    std::cout << "Move constructor took the nodes without allocating\n";
+    
+    Stack<int> copy(moved, other_alloc);
+    copy.top() = 30;
+    assert((contents(copy) == std::vector<int>{30, 2, 1}));
+    assert((contents(moved) == std::vector<int>{3, 2, 1}));
+    std::cout << "Copy is deep\n";
+    
+    // Ресурсы разные: элементы перемещаются, стек остаётся на своём ресурсе.
+    Stack<int> target(other_alloc);
+    target = std::move(moved);
+    assert(moved.empty());
+    assert((contents(target) == std::vector<int>{3, 2, 1}));
+    assert(target.get_allocator().resource() == &other_arena);
+    assert(arena.stats().bytes_in_use == 0);
+    std::cout << "Move between different resources moved the elements\n";
+    
+    Stack<int> b(alloc);
+    b.push(7);
+    swap(target, b);
+    assert((contents(b) == std::vector<int>{3, 2, 1}));
+    assert((contents(target) == std::vector<int>{7}));
+    assert(b.get_allocator().resource() == &arena);
+    
+    Stack<int> lower(alloc);
+    for (int i = 1; i <= 2; ++i) lower.push(i);
+    allocations = arena.stats().allocations;
+    lower.splice(b);
+    assert(b.empty());
+    assert((contents(lower) == std::vector<int>{3, 2, 1, 2, 1}));
+    assert(arena.stats().allocations == allocations);
+    lower.push(4);
+    lower.splice(target);
+    assert((contents(lower) == std::vector<int>{7, 4, 3, 2, 1, 2, 1}));
+    lower.clear();
+    assert(arena.stats().bytes_in_use == 0);
+    std::cout << "Splice relinked nodes of equal resources without allocating\n";
+    
+    Stack<int, ChunkedStorage<2>> chunked(alloc);
+    Stack<int, ChunkedStorage<2>> chunked_top(alloc);
+    for (int i = 1; i <= 3; ++i) chunked.push(i);
+    for (int i = 4; i <= 5; ++i) chunked_top.push(i);
+    Stack<int, ChunkedStorage<2>> chunked_copy(chunked);
+    chunked.splice(chunked_top);
+    chunked.push(6);
+    assert((contents(chunked) == std::vector<int>{6, 5, 4, 3, 2, 1}));
+    Stack<int, ChunkedStorage<2>> chunked_moved(std::move(chunked));
+    assert(chunked.empty() && chunked_moved.size() == 6);
+    chunked_copy.swap(chunked_moved);
+    assert((contents(chunked_copy) == std::vector<int>{6, 5, 4, 3, 2, 1}));
+    assert((contents(chunked_moved) == std::vector<int>{3, 2, 1}));
+    std::cout << "Chunked storage supports the same operations\n";
+    
+    std::cout << "Move, swap and splice test passed\n\n";
+}
+
+void test_stack_uses_allocator() {
+    std::cout << "Testing Uses-Allocator Propagation\n";
+    
+    // Ресурс по умолчанию отключён: любое выделение мимо арены бросит bad_alloc.
+    std::pmr::memory_resource* previous = std::pmr::set_default_resource(std::pmr::null_memory_resource());
+    {
+        InstrumentedFixedBufferResource arena(16 * 1024);
+        std::pmr::polymorphic_allocator<Person> alloc(&arena);
+        {
+            Stack<Person> people(alloc);
+            people.emplace("Frederick the Long-Named", 52);
+            people.push(Person("Genevieve Also Long-Named", 47, alloc));
+            assert(people.top().get_allocator().resource() == &arena);
+            
+            Stack<Person, ChunkedStorage<4>> chunked(alloc);
+            chunked.push(people.top());
+            assert(chunked.top().get_allocator().resource() == &arena);
+            std::cout << "Long names were allocated from the stack's arena\n";
+            
+            Stack<Stack<std::pmr::string>> nested{std::pmr::polymorphic_allocator<Stack<std::pmr::string>>(&arena)};
+            nested.emplace().emplace("a string that does not fit into SSO");
+            assert(nested.top().get_allocator().resource() == &arena);
+            assert(nested.top().top().get_allocator().resource() == &arena);
+            std::cout << "Nested stacks share the outer stack's arena\n";
+        }
+        assert(arena.stats().bytes_in_use == 0);
+        std::cout << "Whole object graph was returned to the arena\n";
+    }
+    std::pmr::set_default_resource(previous);
+    
+    std::cout << "Uses-allocator propagation test passed\n\n";
+}
+
+void test_stack_copy_to() {
+    std::cout << "Testing Stack copy_to\n";
+    
+    std::vector<int> values(100);
+    for (int i = 0; i < 100; ++i) values[i] = i;
+    
+    Stack<int, ChunkedStorage<8>> chunked;
+    chunked.push(-3);
+    chunked.push(-2);
+    chunked.push(-1);
+    chunked.push_range(values.data(), values.data() + values.size());
+    assert(chunked.size() == 103 && chunked.top() == 99);
+    std::vector<int> out(chunked.size());
+    assert(chunked.copy_to(out.data()) == out.data() + out.size());
+    assert(out[0] == -3 && out[2] == -1);
+    assert(std::equal(values.begin(), values.end(), out.begin() + 3));
+    std::cout << "Chunked push_range and copy_to kept the push order\n";
+    
+    Stack<int> nodes;
+    nodes.push_range(out.data(), out.data() + out.size());
+    std::vector<int> node_out(nodes.size());
+    nodes.copy_to(node_out.data());
+    assert(node_out == out);
+    
+    Stack<std::pmr::string, ChunkedStorage<2>> strings;
+    strings.push("bottom");
+    strings.push("middle");
+    strings.push("top");
+    std::vector<std::pmr::string> string_out(strings.size());
+    strings.copy_to(string_out.data());
+    assert(string_out[0] == "bottom" && string_out[2] == "top");
+    std::cout << "Non-trivial elements are copied one by one\n";
+    
+    std::cout << "copy_to test passed\n\n";
+}
+
+void test_static_and_small_stack() {
+    std::cout << "Testing StaticStack And SmallStack\n";
+    
+    StaticStack<int, 4> fixed;
+    for (int i = 1; i <= 4; ++i) fixed.push(i);
+    assert(fixed.full() && fixed.top() == 4);
+    bool overflowed = false;
+    try {
+        fixed.push(5);
+    } catch (const std::bad_alloc&) {
+        overflowed = true;
+    }
+    assert(overflowed && fixed.size() == 4);
+    assert((std::vector<int>(fixed.begin(), fixed.end()) == std::vector<int>{4, 3, 2, 1}));
+    StaticStack<int, 4> fixed_copy(fixed);
+    fixed.pop();
+    assert(fixed.top() == 3 && fixed_copy.top() == 4);
+    std::cout << "StaticStack rejects the element past its capacity\n";
+    
+    InstrumentedFixedBufferResource arena(16 * 1024);
+    SmallStack<std::pmr::string, 3> small{std::pmr::polymorphic_allocator<std::pmr::string>(&arena)};
+    small.push("first");
+    small.push("second");
+    small.push("third");
+    assert(!small.spilled() && arena.stats().allocations == 0);
+    small.push("a string that is too long for SSO");
+    small.push("fifth");
+    assert(small.spilled() && small.size() == 5);
+    assert(arena.stats().allocations > 0);
+    assert(small.top() == "fifth");
+    assert(small.top().get_allocator().resource() == &arena);
+    std::cout << "SmallStack spilled into the resource only past 3 elements\n";
+    
+    std::vector<std::pmr::string> seen(small.begin(), small.end());
+    assert(seen.size() == 5 && seen[0] == "fifth" && seen[4] == "first");
+    
+    SmallStack<std::pmr::string, 3> moved(std::move(small));
+    assert(small.empty() && moved.size() == 5);
+    assert(moved.pop_n(4) == 4);
+    assert(!moved.spilled() && moved.top() == "first");
+    std::cout << "SmallStack moved and popped across the inline boundary\n";
+    
+    std::cout << "StaticStack and SmallStack test passed\n\n";
+}
+
+void test_fixed_buffer_allocator() {
+    std::cout << "Testing FixedBufferAllocator\n";
+    
+    InstrumentedFixedBufferResource arena(16 * 1024);
+    {
+        using Alloc = FixedBufferAllocator<int, InstrumentedFixedBufferResource>;
+        Stack<int, NodeStorage, Alloc> stack{Alloc(&arena)};
+        int values[] = {1, 2, 3, 4, 5};
+        stack.push_range(std::begin(values), std::end(values));
+        assert(arena.stats().allocations == 1);
+        stack.push(6);
+        assert(stack.size() == 6 && stack.top() == 6);
+        assert(stack.get_allocator().resource() == &arena);
+        Stack<int, NodeStorage, Alloc> copy(stack);
+        assert(copy.get_allocator() == stack.get_allocator());
+        assert((contents(copy) == std::vector<int>{6, 5, 4, 3, 2, 1}));
+        std::cout << "Nodes come from the arena through the concrete resource type\n";
+        
+        using StringAlloc = FixedBufferAllocator<std::pmr::string, InstrumentedFixedBufferResource>;
+        Stack<std::pmr::string, ChunkedStorage<4>, StringAlloc> strings{StringAlloc(&arena)};
+        strings.emplace("a string that does not fit into SSO");
+        assert(strings.top().get_allocator().resource() == &arena);
+        std::cout << "pmr elements receive the same arena\n";
+    }
+    assert(arena.stats().bytes_in_use == 0);
+    
+    std::cout << "FixedBufferAllocator test passed\n\n";
+}
+
+std::vector<std::string> guard_messages;
+
+void record_guard_error(const char* message, const void*) {
+    guard_messages.push_back(message);
+}
+
+void test_checked_fixed_buffer_resource() {
+    std::cout << "Testing CheckedFixedBufferResource\n";
+    
+    static_assert(!CheckedFixedBufferResource::partial_deallocation, "guarded blocks cannot be split");
+    static_assert(std::is_same_v<FixedBufferResource, BasicFixedBufferResource<>>,
+                  "STACK_CHECKED_RESOURCE=0 keeps FixedBufferResource unguarded");
+    guard_messages.clear();
+    CheckedFixedBufferResource resource(64 * 1024);
+    resource.set_guard_handler(record_guard_error);
+    
+    char* p = static_cast<char*>(resource.allocate(40, 64));
+    assert(reinterpret_cast<std::uintptr_t>(p) % 64 == 0);
+    assert(static_cast<unsigned char>(p[0]) == 0xCD);
+    resource.deallocate(p, 40, 64);
+    resource.deallocate(p, 40, 64);
+    assert(guard_messages.size() == 1 && guard_messages.back() == "double free");
+    std::cout << "Double free detected\n";
+    
+    void* q = resource.allocate(32, 8);
+    resource.deallocate(q, 16, 8);
+    assert(guard_messages.size() == 2);
+    resource.deallocate(q, 32, 8);
+    assert(guard_messages.size() == 2);
+    alignas(16) char foreign[64];
+    resource.deallocate(foreign + 32, 16, 16);
+    assert(guard_messages.size() == 3);
+    std::cout << "Size mismatch and foreign pointer detected\n";
+    
+#if !FIXED_BUFFER_HAS_ASAN
+    // Под ASan эти записи ловит сам санитайзер: красные зоны и карантин помечены.
+    char* r = static_cast<char*>(resource.allocate(24, 8));
+    r[24] = 0;
+    resource.deallocate(r, 24, 8);
+    assert(guard_messages.size() == 4);
+    char* s = static_cast<char*>(resource.allocate(24, 8));
+    resource.deallocate(s, 24, 8);
+    s[0] = 1;
+    resource.flush_quarantine();
+    assert(guard_messages.size() == 5);
+    std::cout << "Overflow into the red zone and use after free detected\n";
+#endif
+    
+    std::size_t errors = resource.guard_errors();
+    {
+        Stack<int> stack(&resource);
+        for (int i = 0; i < 100; ++i) stack.push(i);
+        int values[] = {1, 2, 3, 4};
+        stack.push_range(std::begin(values), std::end(values));
+        stack.pop_n(50);
+        assert(stack.size() == 54 && stack.top() == 53);
+    }
+    resource.flush_quarantine();
+    assert(resource.guard_errors() == errors);
+    resource.release();
+    assert(resource.allocate(16, 8) != nullptr);
+    std::cout << "Stack runs cleanly on the checked resource\n";
+    
+    std::cout << "CheckedFixedBufferResource test passed\n\n";
+}
+
+void test_stack_latency_tracing() {
+    std::cout << "Testing Latency Tracing\n";
+    
+    using TracedStack = Stack<int, NodeStorage, std::pmr::polymorphic_allocator<int>, LatencyTracing>;
+    static_assert(sizeof(TracedStack) == sizeof(Stack<int>), "tracing must not grow the stack");
+    static_assert(std::is_empty_v<detail::TraceScope<NoTracing>>, "disabled tracing must cost nothing");
+    
+    clear_trace();
+    TracedFixedBufferResource resource(64 * 1024);
+    {
+        TracedStack stack(&resource);
+        stack.push(1);
+        stack.push(2);
+        stack.push(3);
+        stack.pop();
+        int values[] = {4, 5, 6, 7};
+        stack.push_range(std::begin(values), std::end(values));
+        
+        std::vector<TraceSpan> spans = collect_trace();
+        auto count = [&spans](TraceEvent event) {
+            return std::count_if(spans.begin(), spans.end(), [event](const TraceSpan& s) { return s.event == event; });
+        };
+        assert(count(TraceEvent::push) == 3 && count(TraceEvent::pop) == 1);
+        assert(count(TraceEvent::push_range) == 1 && count(TraceEvent::allocate) == 4);
+        assert(count(TraceEvent::deallocate) == 1);
+        for (const TraceSpan& s : spans) {
+            assert(s.begin <= s.end);
+            if (s.event == TraceEvent::push_range) assert(s.size == 4);
+        }
+        // Каждое выделение вложено в push, который его вызвал.
+        for (const TraceSpan& push : spans) {
+            if (push.event != TraceEvent::push) continue;
+            assert(std::any_of(spans.begin(), spans.end(), [&push](const TraceSpan& s) {
+                return s.event == TraceEvent::allocate && s.begin >= push.begin && s.end <= push.end;
+            }));
+        }
+        std::cout << "Allocation spans are nested inside the push that caused them\n";
+        
+        std::ostringstream chrome;
+        write_chrome_trace(chrome, spans);
+        assert(chrome.str().rfind("{\"traceEvents\":[", 0) == 0);
+        assert(chrome.str().find("\"name\":\"allocate\"") != std::string::npos);
+        std::ostringstream csv;
+        write_trace_csv(csv, spans);
+        assert(csv.str().rfind("thread,event,begin_ns,duration_ns,size\n", 0) == 0);
+        std::cout << "Exported " << spans.size() << " events as Chrome trace and CSV\n";
+    }
+    
+    clear_trace();
+    // Потоки живут одновременно, иначе второй получил бы освободившийся буфер первого.
+    std::atomic<int> started{0}, finished{0};
+    auto work = [&started, &finished] {
+        started.fetch_add(1);
+        while (started.load() < 2) std::this_thread::yield();
+        Stack<int, ChunkedStorage<8>, std::pmr::polymorphic_allocator<int>, LatencyTracing> stack;
+        for (int i = 0; i < 100; ++i) stack.push(i);
+        stack.pop_n(100);
+        finished.fetch_add(1);
+        while (finished.load() < 2) std::this_thread::yield();
+    };
+    std::thread a(work), b(work);
+    a.join();
+    b.join();
+    std::vector<TraceSpan> spans = collect_trace();
+    assert(spans.size() == 202);
+    assert(std::is_sorted(spans.begin(), spans.end(),
+                          [](const TraceSpan& x, const TraceSpan& y) { return x.begin < y.begin; }));
+    assert(std::any_of(spans.begin(), spans.end(), [&spans](const TraceSpan& s) { return s.thread != spans[0].thread; }));
+    std::cout << "Events from two threads were collected from their own rings\n";
+    clear_trace();
+    
+    std::cout << "Latency tracing test passed\n\n";
+}
+
+void test_stack_node_layout() {
+    std::cout << "Testing Stack Node Layout And Prefetching\n";
+    
+    struct Record {
+        int id;
+        char payload[100];
+    };
+    using AlignedStack = Stack<Record, LinkFirstStorage<64>>;
+    static_assert(AlignedStack::node_alignment == 64, "nodes must be cache-line aligned");
+    static_assert(AlignedStack::node_size % 64 == 0, "nodes must fill whole cache lines");
+    static_assert(Stack<int, LinkFirstStorage<>>::node_size == Stack<int>::node_size,
+                  "link-first layout without alignment must not grow the node");
+    
+    FixedBufferResource resource(64 * 1024);
+    AlignedStack records{std::pmr::polymorphic_allocator<Record>(&resource)};
+    for (int i = 0; i < 100; ++i) records.push(Record{i, {}});
+    // Узел начинается на границе кэш-линии, а значение идёт сразу за указателем next.
+    for (Record& r : records) assert(reinterpret_cast<std::uintptr_t>(&r) % 64 == sizeof(void*));
+    std::cout << "Link-first nodes are aligned to a cache line\n";
+    
+    int expected = 99;
+    for (Record& r : records.prefetched<8>()) assert(r.id == expected--);
+    assert(expected == -1);
+    Stack<int> small_stack;
+    small_stack.push(1);
+    small_stack.push(2);
+    std::vector<int> seen;
+    for (int value : small_stack.prefetched<16>()) seen.push_back(value);
+    assert((seen == std::vector<int>{2, 1}));
+    std::cout << "Prefetching iterator visits every element in order\n";
+    
+    std::cout << "Node layout test passed\n\n";
+}
+
+void test_stack_parallel() {
+    std::cout << "Testing Parallel Traversal\n";
+    
+    const int n = 20000;
+    Stack<int> nodes;
+    Stack<int, ChunkedStorage<64>> chunked;
+    for (int i = 1; i <= n; ++i) {
+        nodes.push(i);
+        chunked.push(i);
+    }
+    const long long expected = 1LL * n * (n + 1) / 2;
+    
+    auto plus = [](long long a, long long b) { return a + b; };
+    auto widen = [](int v) { return static_cast<long long>(v); };
+    assert(nodes.transform_reduce(0LL, plus, widen, 4) == expected);
+    assert(chunked.transform_reduce(10LL, plus, widen, 4) == expected + 10);
+    assert(Stack<int>().transform_reduce(7LL, plus, widen, 4) == 7);
+    std::cout << "transform_reduce over 4 threads matches the serial sum\n";
+    
+    std::atomic<long long> visited{0};
+    nodes.parallel_for_each([&visited](int& v) { v *= 2; visited += 1; }, 4);
+    chunked.parallel_for_each([](int& v) { v *= 2; }, 4);
+    assert(visited == n);
+    assert(nodes.transform_reduce(0LL, plus, widen) == 2 * expected);
+    assert(chunked.transform_reduce(0LL, plus, widen) == 2 * expected);
+    std::cout << "parallel_for_each visited every element exactly once\n";
+    
+    bool rethrown = false;
+    try {
+        chunked.parallel_for_each([](int& v) {
+            if (v == 2 * n) throw std::runtime_error("last element");
+        }, 4);
+    } catch (const std::runtime_error&) {
+        rethrown = true;
+    }
+    assert(rethrown);
+    std::cout << "Exception from a worker thread reached the caller\n";
+    
+    std::cout << "Parallel traversal test passed\n\n";
+}
+
+// Копируется с исключением на fail_at-й копии (один раз); перемещение не noexcept.
+struct FlakyCopy {
+    static inline int fail_at = -1;
+    int value;
+    
+    explicit FlakyCopy(int v) : value(v) {}
+    FlakyCopy(const FlakyCopy& other) : value(other.value) {
+        if (fail_at > 0 && --fail_at == 0) {
+            fail_at = -1;
+            throw std::runtime_error("copy failed");
+        }
+    }
+    FlakyCopy(FlakyCopy&& other) : FlakyCopy(static_cast<const FlakyCopy&>(other)) {}
+};
+
+void test_concurrent_stack() {
+    std::cout << "Testing ConcurrentStack\n";
+    
+    FixedBufferResource resource(64 * 1024);
+    ConcurrentStack<int> stack(1024, &resource);
+    
+    assert(stack.empty());
+    stack.push(1);
+    stack.push(2);
+    assert(*stack.try_pop() == 2);
+    assert(*stack.try_pop() == 1);
+    assert(!stack.try_pop());
+    std::cout << "Single-threaded LIFO order preserved\n";
+    
+    const int threads = 4;
+    const int per_thread = 10000;
+    std::atomic<long long> popped_sum{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < per_thread; ++i) {
+                stack.push(t * per_thread + i);
+                while (true) {
+                    if (auto value = stack.try_pop()) {
+                        popped_sum += *value;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    
+    long long total = static_cast<long long>(threads) * per_thread;
+    assert(stack.empty());
+    assert(popped_sum == total * (total - 1) / 2);
+    std::cout << "Every value pushed by " << threads << " threads was popped exactly once\n";
+    
+    ConcurrentStack<int> eliminating(1024, &resource, 8);
+    std::atomic<long long> eliminated_sum{0};
+    workers.clear();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < per_thread; ++i) {
+                eliminating.push(t * per_thread + i);
+                while (true) {
+                    if (auto value = eliminating.try_pop()) {
+                        eliminated_sum += *value;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    assert(eliminating.empty());
+    assert(eliminated_sum == total * (total - 1) / 2);
+    auto stats = eliminating.elimination_stats();
+    assert(stats.successes <= stats.attempts);
+    
+    // Массив исключения работает только при конфликтах на вершине, поэтому гоняем
+    // раунды с пачками push и pop, пока к нему не обратятся (с ограничением по
+    // времени). Каждый раунд проверяет, что ни один элемент не потерян и не повторён,
+    // в том числе переданный через ячейку; на одном ядре обменов может и не быть.
+    const int rounds_threads = 8;
+    const int batch = 16;
+    const int round_per_thread = 32 * batch;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    int rounds = 0;
+    do {
+        std::atomic<long long> round_sum{0};
+        std::atomic<int> round_count{0};
+        workers.clear();
+        for (int t = 0; t < rounds_threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (int i = 0; i < round_per_thread; i += batch) {
+                    for (int j = 0; j < batch; ++j) eliminating.push(t * round_per_thread + i + j);
+                    for (int j = 0; j < batch;) {
+                        if (auto value = eliminating.try_pop()) {
+                            round_sum += *value;
+                            ++round_count;
+                            ++j;
+                        }
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) worker.join();
+        long long round_total = rounds_threads * round_per_thread;
+        assert(eliminating.empty());
+        assert(round_count == round_total);
+        assert(round_sum == round_total * (round_total - 1) / 2);
+        stats = eliminating.elimination_stats();
+        ++rounds;
+    } while (stats.attempts == 0 && std::chrono::steady_clock::now() < deadline);
+    assert(stats.attempts > 0);
+    assert(stats.successes <= stats.attempts);
+    std::cout << "With elimination: " << stats.successes << " exchanges out of "
+              << stats.attempts << " attempts in " << rounds << " contended rounds, no element lost\n";
+    
+    // Исключение при перемещении значения оставляет элемент в стеке.
+    ConcurrentStack<FlakyCopy> flaky(2, &resource);
+    flaky.push(FlakyCopy(1));
+    flaky.push(FlakyCopy(2));
+    FlakyCopy::fail_at = 1;
+    bool move_failed = false;
+    try {
+        (void)flaky.try_pop();
+    } catch (const std::runtime_error&) {
+        move_failed = true;
+    }
+    assert(move_failed);
+    assert(flaky.try_pop()->value == 2);
+    assert(flaky.try_pop()->value == 1);
+    flaky.push(FlakyCopy(3));
+    flaky.push(FlakyCopy(4));
+    assert(flaky.try_pop()->value == 4);
+    std::cout << "A throwing move keeps the element and its node\n";
+    
+    ConcurrentStack<int> tiny(1, &resource);
+    tiny.push(1);
+    bool thrown = false;
+    try {
+        tiny.push(2);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    assert(thrown);
+    
+    std::cout << "ConcurrentStack test passed\n\n";
+}
+
+void test_concurrent_fixed_buffer_resource() {
+    std::cout << "Testing ConcurrentFixedBufferResource\n";
+    
+    ConcurrentFixedBufferResource resource(64 * 1024);
+    
+    void* ptr1 = resource.allocate(16, 8);
+    resource.deallocate(ptr1, 16, 8);
+    void* ptr2 = resource.allocate(16, 8);
+    assert(ptr1 == ptr2);
+    resource.deallocate(ptr2, 16, 8);
+    std::cout << "Freed block served again from the thread cache\n";
+    
+    const int threads = 4;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&resource, t] {
+            std::pmr::polymorphic_allocator<int> alloc(&resource);
+            Stack<int> stack(alloc);
+            for (int round = 0; round < 50; ++round) {
+                for (int i = 0; i < 200; ++i) stack.push(t * 1000 + i);
+                assert(stack.top() == t * 1000 + 199);
+                stack.clear();
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    std::cout << threads << " threads shared one buffer through their own stacks\n";
+    
+    std::vector<void*> blocks;
+    try {
+        for (;;) blocks.push_back(resource.allocate(48, 8));
+    } catch (const std::bad_alloc&) {
+    }
+    assert(blocks.size() * 48 > 60 * 1024);
+    std::cout << "Buffer was filled up to its bound with " << blocks.size() << " blocks\n";
+    resource.release();
+    
+    // Кэш потока привязан к номеру ресурса, а не к адресу: новый ресурс на месте
+    // удалённого получает свой кэш, а не блоки чужого буфера.
+    for (int round = 0; round < 3; ++round) {
+        ConcurrentFixedBufferResource scratch(4096);
+        void* p = scratch.allocate(16, 8);
+        scratch.deallocate(p, 16, 8);
+        void* q = resource.allocate(16, 8);
+        resource.deallocate(q, 16, 8);
+        assert(scratch.allocate(16, 8) == p);
+    }
+    std::cout << "Thread caches follow each resource separately\n";
+    
+    // Единственную ячейку кэша занимает главный поток, остальные идут в общий буфер.
+    ConcurrentFixedBufferResource single(64 * 1024, 1);
+    void* own = single.allocate(16, 8);
+    single.deallocate(own, 16, 8);
+    workers.clear();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&single, t] {
+            Stack<int> stack{std::pmr::polymorphic_allocator<int>(&single)};
+            for (int round = 0; round < 20; ++round) {
+                for (int i = 0; i < 100; ++i) stack.push(t * 1000 + i);
+                assert(stack.top() == t * 1000 + 99);
+                stack.clear();
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    assert(single.allocate(16, 8) == own);
+    std::cout << "Threads beyond the cache slots use the shared buffer directly\n";
+    
+    std::cout << "ConcurrentFixedBufferResource test passed\n\n";
+}
+
+void test_sharded_stack() {
+    std::cout << "Testing ShardedStack\n";
+    
+    ShardedStack<int> stack(64 * 1024, 4);
+    
+    std::thread producer([&stack] {
+        for (int i = 0; i < 100; ++i) stack.push(i);
+    });
+    producer.join();
+    assert(stack.size() == 100);
+    std::cout << "Producer thread filled its shard\n";
+    
+    long long sum = 0;
+    int popped = 0;
+    while (auto value = stack.try_pop()) {
+        sum += *value;
+        ++popped;
+    }
+    assert(popped == 100);
+    assert(sum == 99 * 100 / 2);
+    std::cout << "Another thread stole all " << popped << " elements\n";
+    
+    const int threads = 4;
+    std::atomic<long long> total{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i < 1000; ++i) stack.push(t);
+            for (int i = 0; i < 1000; ++i) {
+                if (auto value = stack.try_pop()) total += *value + 1;
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    stack.for_each([&total](int value) { total += value + 1; });
+    assert(total == 1000LL * (1 + 2 + 3 + 4));
+    std::cout << "No element lost or duplicated across shards\n";
+    
+    // Производитель должен попасть в другой шард, иначе красть будет нечего.
+    ShardedStack<FlakyCopy> flaky(64 * 1024, 2);
+    std::size_t main_shard = detail::thread_slot() % 2;
+    for (bool filled = false; !filled;) {
+        std::thread producer([&] {
+            if (detail::thread_slot() % 2 == main_shard) return;
+            for (int i = 0; i < 10; ++i) flaky.push(FlakyCopy(i));
+            filled = true;
+        });
+        producer.join();
+    }
+    FlakyCopy::fail_at = 3;
+    int flaky_sum = 0, flaky_count = 0;
+    while (auto value = flaky.try_pop()) {
+        flaky_sum += value->value;
+        ++flaky_count;
+    }
+    assert(FlakyCopy::fail_at == -1);
+    assert(flaky_count == 10 && flaky_sum == 45);
+    std::cout << "Failed copy during a steal lost no elements\n";
+    
+    // Пока другой поток держит мьютекс соседнего шарда, try_pop ждёт его, а не
+    // сообщает о пустом стеке.
+    ShardedStack<int> busy(64 * 1024, 2);
+    for (bool filled = false; !filled;) {
+        std::thread producer([&] {
+            if (detail::thread_slot() % 2 == main_shard) return;
+            busy.push(7);
+            filled = true;
+        });
+        producer.join();
+    }
+    std::atomic<bool> holding{false};
+    std::thread holder([&] {
+        busy.for_each([&holding](int) {
+            holding = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        });
+    });
+    while (!holding) std::this_thread::yield();
+    std::optional<int> stolen = busy.try_pop();
+    holder.join();
+    assert(stolen && *stolen == 7);
+    std::cout << "A busy shard is waited for instead of reported empty\n";
+    
+    std::cout << "ShardedStack test passed\n\n";
+}
+
+void test_fragmentation_workload() {
+    std::cout << "Testing Fragmentation Workload\n";
+    
+    WorkloadConfig config;
+    config.seed = 42;
+    config.operations = 20000;
+    config.sample_every = 500;
+    
+    // Одинаковый seed даёт одинаковую последовательность операций и одинаковую картину фрагментации.
+    // Буферы выровнены по максимальному выравниванию нагрузки, иначе отступы зависят от адреса буфера.
+    alignas(64) static unsigned char first_buffer[256 * 1024];
+    alignas(64) static unsigned char second_buffer[256 * 1024];
+    InstrumentedFixedBufferResource first(first_buffer, sizeof(first_buffer));
+    InstrumentedFixedBufferResource second(second_buffer, sizeof(second_buffer));
+    WorkloadReport a = run_fragmentation_workload(first, config);
+    WorkloadReport b = run_fragmentation_workload(second, config);
+    assert(a.samples.size() == config.operations / config.sample_every);
+    assert(a.samples.size() == b.samples.size());
+    for (std::size_t i = 0; i < a.samples.size(); ++i) {
+        assert(a.samples[i].live_bytes == b.samples[i].live_bytes);
+        assert(a.samples[i].fragmentation == b.samples[i].fragmentation);
+    }
+    assert(first.stats().bytes_in_use == 0);
+    std::cout << "Same seed reproduced " << a.samples.size() << " fragmentation samples\n";
+    
+    // При равновесии выделений и освобождений буфер не исчерпывается, а фрагментация остаётся ограниченной.
+    assert(a.failed_allocations == 0);
+    for (const WorkloadSample& s : a.samples) assert(s.fragmentation < 0.5);
+    std::cout << "Steady state fragmentation stayed below 0.5\n";
+    
+    // С перевесом выделений ресурс исчерпывается, и номер первой неудачи фиксируется.
+    config.alloc_percent = 70;
+    InstrumentedFixedBufferResource small(64 * 1024);
+    WorkloadReport grow = run_fragmentation_workload(small, config);
+    assert(grow.first_bad_alloc_operation != 0);
+    assert(grow.operations == grow.first_bad_alloc_operation);
+    assert(small.stats().bytes_in_use == 0);
+    std::cout << "Growing workload hit bad_alloc at operation " << grow.first_bad_alloc_operation << "\n";
+    
+    std::ostringstream csv;
+    a.write_csv(csv);
+    assert(csv.str().rfind("operation,live_blocks,live_bytes,fragmentation\n", 0) == 0);
+    
+    std::cout << "Fragmentation workload test passed\n\n";
+}
+
 int main() {
     std::cout << "Starting tests...\n\n";
     
     try {
         test_fixed_buffer_resource_basic();
         test_fixed_buffer_resource_reuse();
+        test_fixed_buffer_resource_size_classes();
+        test_fixed_buffer_resource_coalescing();
+        test_fixed_buffer_resource_intrusive();
+        test_fixed_buffer_resource_stats();
+        test_fixed_buffer_resource_upstream();
+        test_fixed_buffer_resource_external_buffer();
         test_stack_basic();
+        test_stack_node_allocation_size();
         test_stack_iterator();
+        test_node_pool_resource();
         test_stack_complex_type();
+        test_chunked_stack();
         test_stack_clear();
+        test_stack_arena_reset();
+        test_stack_emplace();
+        test_stack_bulk_operations();
+        test_stack_serialization();
+        test_stack_move_and_splice();
+        test_stack_uses_allocator();
+        test_stack_copy_to();
+        test_static_and_small_stack();
+        test_fixed_buffer_allocator();
+        test_checked_fixed_buffer_resource();
+        test_stack_latency_tracing();
+        test_stack_node_layout();
+        test_stack_parallel();
+        test_concurrent_stack();
+        test_concurrent_fixed_buffer_resource();
+        test_sharded_stack();
+        test_fragmentation_workload();
         
         std::cout << "All tests passed successfully!\n";
         return 0;